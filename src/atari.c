@@ -19,6 +19,7 @@
 #include "atcio.h"
 #include "atsio.h"
 #include "hw.h"
+#include "journal.h"
 #include "mathpack.h"
 #include <stdio.h>
 #include <string.h>
@@ -58,6 +59,41 @@ static int sys_peek_char(void)
     return sys_proc_char(c);
 }
 
+// Host character input and output, input passes through the journal
+static sim65 host_sim;
+static int (*host_get_char)(void);
+static int (*host_peek_char)(void);
+static void (*host_put_char)(int);
+
+static int journal_get_char_cb(void)
+{
+    int64_t c;
+    if (!journal_get(journal_get_char, &c))
+    {
+        c = host_get_char();
+        journal_put(journal_get_char, c);
+    }
+    return c;
+}
+
+static int journal_peek_char_cb(void)
+{
+    int64_t c;
+    if (!journal_get(journal_peek_char, &c))
+    {
+        c = host_peek_char();
+        journal_put(journal_peek_char, c);
+    }
+    return c;
+}
+
+// Output is not repeated when re-executing from a checkpoint
+static void rewind_put_char_cb(int c)
+{
+    if (!sim65_is_rewinding(host_sim))
+        host_put_char(c);
+}
+
 static void sys_put_char(int c)
 {
     if (c == 0x9b)
@@ -537,19 +573,24 @@ void atari_init(sim65 s, emu_options *opts)
     atari_flags = opts ? opts->flags : 0;
     // Init callbacks
     if (opts && opts->get_char)
-        atari_get_char = opts && opts->get_char ? opts->get_char : sys_get_char;
+        host_get_char = opts && opts->get_char ? opts->get_char : sys_get_char;
     else
-        atari_get_char = sys_get_char;
+        host_get_char = sys_get_char;
+    atari_get_char = journal_get_char_cb;
     if (opts && opts->put_char)
-        atari_put_char = opts->put_char;
+        host_put_char = opts->put_char;
     else
     {
         if (isatty(fileno(stdout)))
-            atari_put_char = sys_put_char_flush;
+            host_put_char = sys_put_char_flush;
         else
-            atari_put_char = sys_put_char;
+            host_put_char = sys_put_char;
     }
-    atari_peek_char = sys_peek_char;
+    host_sim       = s;
+    host_peek_char = sys_peek_char;
+    // Character I/O goes through the rewind and input journal hooks
+    atari_put_char  = rewind_put_char_cb;
+    atari_peek_char = journal_peek_char_cb;
 
     // Add 52k of uninitialized ram, maximum possible for the Atari architecture.
     sim65_add_ram(s, 0, MAX_RAM);
@@ -592,7 +633,7 @@ enum sim65_error atari_xex_load(sim65 s, const char *name, int check)
         {
             if (check && state != 7)
             {
-                sim65_eprintf(s, "%S: truncated file", name);
+                sim65_eprintf(s, "%s: truncated file", name);
                 fclose(f);
                 return sim65_err_user;
             }
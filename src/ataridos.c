@@ -153,6 +153,11 @@ static int sim_DISKD(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
     unsigned ax1  = peek(s, ICAX1Z);
     unsigned ax2  = peek(s, ICAX2Z);
 
+    // Profile each handler function
+    static const char *fn_names[8] = { "OPEN", "CLOSE", "GET", "PUT",
+                                       "STATUS", "SPECIAL", "INIT", "?" };
+    sim65_prof_enter(s, "[DOS:%s]", fn_names[addr & 7]);
+
     switch (addr & 7)
     {
         case DEVR_OPEN:
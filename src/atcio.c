@@ -495,6 +495,12 @@ static int sim_CIOV(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
     sim65_dprintf(s, "CIO #$%02x (%02x), $%02x (%s), $%04x $%04x", regs->x, hid,
                   com, cio_cmd_name(com), dpeek(s, ICBALZ), dpeek(s, ICBLLZ));
 
+    // Profile the calls by device and command, the device is from the file
+    // name when the channel is not open.
+    unsigned dev = (hid != 0xFF) ? peek(s, HATABS + hid) : peek(s, dpeek(s, ICBALZ));
+    sim65_prof_enter(s, "[CIO:%c:%s]", (dev > ' ' && dev < 0x7F) ? dev : '?',
+                     cio_cmd_name(com));
+
     // Error out on invalid command
     if (com < 3)
     {
@@ -245,6 +245,11 @@ static int sim_SIOV(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
                      " dev=%02x:%02x cmd=%02x stat=%02x buf=%04x tim=%02x len=%04x aux=%02x:%02x",
                   ddevic, dunit, dcomnd, dstats, dbuf, dtimlo, dbyt, daux1, daux2);
 
+    if (ddevic == 0x31)
+        sim65_prof_enter(s, "[SIO:D%d:%c]", dunit, (dcomnd > ' ' && dcomnd < 0x7F) ? dcomnd : '?');
+    else
+        sim65_prof_enter(s, "[SIO:%02X:%02X]", ddevic, dcomnd);
+
     int e;
     if (ddevic == 0x31)
         e = sio_disk(s, dunit, dcomnd, dstats, dbuf, dbyt, daux1 + (daux2 << 8));
@@ -0,0 +1,464 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "callgraph.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Max number of native frame names
+#define CG_NATIVE 256
+// Number of routine ids
+#define CG_FUNCS (SIM65_PROF_NATIVE + CG_NATIVE)
+// Max depth of the shadow stack
+#define CG_DEPTH 512
+// Call cycles histogram: 16 buckets for each power of two, up to 2^40 cycles
+#define CG_HIST_SUB  16
+#define CG_HIST_SIZE (CG_HIST_SUB * 37)
+
+// Hash table from 64 bit keys to array indexes.
+struct cg_hash
+{
+    uint64_t *keys; // Key plus one, 0 is an empty slot
+    uint32_t *vals;
+    unsigned mask;
+    unsigned num;
+};
+
+struct cg_frame
+{
+    uint32_t func;
+    uint32_t edge;
+    uint32_t node;
+    uint8_t sp;
+    uint64_t start;
+};
+
+struct callgraph
+{
+    uint64_t calls[CG_FUNCS];
+    uint64_t incl[CG_FUNCS];
+    uint64_t excl[CG_FUNCS];
+    uint32_t active[CG_FUNCS];
+    // Native frame names
+    char *names[CG_NATIVE];
+    unsigned num_names;
+    // Shadow call stack
+    struct cg_frame stack[CG_DEPTH];
+    unsigned depth;
+    // Current routine and context node
+    uint32_t func;
+    uint32_t node;
+    // Edges
+    struct cg_hash edge_hash;
+    struct sim65_call_edge *edges;
+    unsigned num_edges;
+    unsigned max_edges;
+    // Calling context tree
+    struct cg_hash node_hash;
+    struct sim65_cct_node *nodes;
+    unsigned num_nodes;
+    unsigned max_nodes;
+    // Stack depth
+    unsigned min_sp;
+    uint32_t min_sp_node;
+    uint64_t sp_wraps;
+    uint32_t sp_wrap_node;
+    // Zero page bitmaps of each routine
+    uint32_t *zp[CG_FUNCS];
+    // Longest call of each routine and its context, calls over the budget
+    uint64_t max_call[CG_FUNCS];
+    uint32_t max_call_node[CG_FUNCS];
+    uint64_t budget[CG_FUNCS];
+    uint64_t over[CG_FUNCS];
+    // Shortest call, number and total cycles of returned calls, histogram
+    uint64_t min_call[CG_FUNCS];
+    uint64_t ret_calls[CG_FUNCS];
+    uint64_t ret_cycles[CG_FUNCS];
+    uint64_t *hist[CG_FUNCS];
+};
+
+static uint32_t hash64(uint64_t k)
+{
+    k ^= k >> 29;
+    k *= 0xBF58476D1CE4E5B9ULL;
+    k ^= k >> 32;
+    return (uint32_t)k;
+}
+
+static int hash_init(struct cg_hash *h, unsigned size)
+{
+    h->keys = calloc(size, sizeof(uint64_t));
+    h->vals = calloc(size, sizeof(uint32_t));
+    h->mask = size - 1;
+    h->num  = 0;
+    return !h->keys || !h->vals;
+}
+
+static void hash_free(struct cg_hash *h)
+{
+    free(h->keys);
+    free(h->vals);
+}
+
+// Returns slot of the key, empty if not found
+static unsigned hash_slot(const struct cg_hash *h, uint64_t key)
+{
+    unsigned i = hash64(key) & h->mask;
+    while (h->keys[i] && h->keys[i] != key + 1)
+        i = (i + 1) & h->mask;
+    return i;
+}
+
+// Inserts a new key, returns 0 if no error
+static int hash_add(struct cg_hash *h, uint64_t key, uint32_t val)
+{
+    if (2 * (h->num + 1) > h->mask)
+    {
+        struct cg_hash n;
+        if (hash_init(&n, 2 * (h->mask + 1)))
+        {
+            hash_free(&n);
+            return 1;
+        }
+        for (unsigned i = 0; i <= h->mask; i++)
+            if (h->keys[i])
+            {
+                unsigned j = hash_slot(&n, h->keys[i] - 1);
+                n.keys[j]  = h->keys[i];
+                n.vals[j]  = h->vals[i];
+            }
+        n.num = h->num;
+        hash_free(h);
+        *h = n;
+    }
+    unsigned i = hash_slot(h, key);
+    h->keys[i] = key + 1;
+    h->vals[i] = val;
+    h->num++;
+    return 0;
+}
+
+// Grows an array if needed, returns 0 if no error
+static int grow(void **ptr, unsigned *max, unsigned num, size_t elem)
+{
+    if (num < *max)
+        return 0;
+    unsigned nmax = *max ? *max * 2 : 1024;
+    void *p       = realloc(*ptr, nmax * elem);
+    if (!p)
+        return 1;
+    *ptr = p;
+    *max = nmax;
+    return 0;
+}
+
+callgraph *cg_new(void)
+{
+    callgraph *cg = calloc(1, sizeof(struct callgraph));
+    if (!cg)
+        return 0;
+    if (hash_init(&cg->edge_hash, 1024) || hash_init(&cg->node_hash, 1024) ||
+        grow((void **)&cg->nodes, &cg->max_nodes, 0, sizeof(struct sim65_cct_node)))
+    {
+        cg_free(cg);
+        return 0;
+    }
+    // Root node, for cycles outside any routine
+    cg->nodes[0].parent  = 0;
+    cg->nodes[0].func    = SIM65_PROF_NATIVE;
+    cg->nodes[0].cycles  = 0;
+    cg->nodes[0].samples = 0;
+    cg->num_nodes        = 1;
+    cg->names[0]         = strdup("[root]");
+    cg->num_names        = 1;
+    cg->func             = SIM65_PROF_NATIVE;
+    cg->min_sp           = 0x100;
+    return cg;
+}
+
+void cg_free(callgraph *cg)
+{
+    if (!cg)
+        return;
+    for (unsigned i = 0; i < cg->num_names; i++)
+        free(cg->names[i]);
+    for (unsigned i = 0; i < CG_FUNCS; i++)
+    {
+        free(cg->zp[i]);
+        free(cg->hist[i]);
+    }
+    hash_free(&cg->edge_hash);
+    hash_free(&cg->node_hash);
+    free(cg->edges);
+    free(cg->nodes);
+    free(cg);
+}
+
+static uint32_t get_edge(callgraph *cg, uint32_t site, uint32_t callee)
+{
+    uint64_t key = ((uint64_t)cg->func << 40) | ((uint64_t)site << 20) | callee;
+    unsigned i   = hash_slot(&cg->edge_hash, key);
+    if (cg->edge_hash.keys[i])
+        return cg->edge_hash.vals[i];
+    if (grow((void **)&cg->edges, &cg->max_edges, cg->num_edges,
+             sizeof(struct sim65_call_edge)) ||
+        hash_add(&cg->edge_hash, key, cg->num_edges))
+        return UINT32_MAX;
+    struct sim65_call_edge *e = &cg->edges[cg->num_edges];
+    e->caller = cg->func;
+    e->site   = site;
+    e->callee = callee;
+    e->calls  = 0;
+    e->cycles = 0;
+    return cg->num_edges++;
+}
+
+static uint32_t get_node(callgraph *cg, uint32_t parent, uint32_t func)
+{
+    uint64_t key = ((uint64_t)parent << 20) | func;
+    unsigned i   = hash_slot(&cg->node_hash, key);
+    if (cg->node_hash.keys[i])
+        return cg->node_hash.vals[i];
+    if (grow((void **)&cg->nodes, &cg->max_nodes, cg->num_nodes,
+             sizeof(struct sim65_cct_node)) ||
+        hash_add(&cg->node_hash, key, cg->num_nodes))
+        return parent;
+    struct sim65_cct_node *n = &cg->nodes[cg->num_nodes];
+    n->parent  = parent;
+    n->func    = func;
+    n->cycles  = 0;
+    n->samples = 0;
+    return cg->num_nodes++;
+}
+
+static void push(callgraph *cg, uint32_t site, uint32_t func, uint8_t sp,
+                 uint64_t cycles)
+{
+    if (cg->depth >= CG_DEPTH)
+        return;
+    struct cg_frame *f = &cg->stack[cg->depth++];
+    f->func   = func;
+    f->edge   = get_edge(cg, site, func);
+    f->node   = get_node(cg, cg->node, func);
+    f->sp     = sp;
+    f->start  = cycles;
+    if (f->edge != UINT32_MAX)
+        cg->edges[f->edge].calls++;
+    cg->calls[func]++;
+    cg->active[func]++;
+    cg->func = func;
+    cg->node = f->node;
+}
+
+// Histogram bucket of a number of cycles, exact below CG_HIST_SUB
+static unsigned hist_bucket(uint64_t t)
+{
+    if (t < CG_HIST_SUB)
+        return t;
+    unsigned e = 63 - __builtin_clzll(t) - 4;
+    unsigned b = CG_HIST_SUB * (e + 1) + ((t >> e) & (CG_HIST_SUB - 1));
+    return b < CG_HIST_SIZE ? b : CG_HIST_SIZE - 1;
+}
+
+// Highest number of cycles in a bucket
+static uint64_t hist_value(unsigned b)
+{
+    if (b < CG_HIST_SUB)
+        return b;
+    unsigned e = b / CG_HIST_SUB - 1;
+    return ((uint64_t)(CG_HIST_SUB + b % CG_HIST_SUB + 1) << e) - 1;
+}
+
+static void add_latency(callgraph *cg, uint32_t func, uint64_t t)
+{
+    if (!cg->ret_calls[func]++ || t < cg->min_call[func])
+        cg->min_call[func] = t;
+    cg->ret_cycles[func] += t;
+    if (!cg->hist[func] && !(cg->hist[func] = calloc(CG_HIST_SIZE, sizeof(uint64_t))))
+        return;
+    cg->hist[func][hist_bucket(t)]++;
+}
+
+static void pop(callgraph *cg, uint64_t cycles)
+{
+    struct cg_frame *f = &cg->stack[--cg->depth];
+    uint64_t t         = cycles - f->start;
+    // Don't count recursive calls twice
+    if (!--cg->active[f->func])
+        cg->incl[f->func] += t;
+    if (t > cg->max_call[f->func])
+    {
+        cg->max_call[f->func]      = t;
+        cg->max_call_node[f->func] = f->node;
+    }
+    if (cg->budget[f->func] && t > cg->budget[f->func])
+        cg->over[f->func]++;
+    add_latency(cg, f->func, t);
+    if (f->edge != UINT32_MAX)
+        cg->edges[f->edge].cycles += t;
+    if (cg->depth)
+    {
+        cg->func = cg->stack[cg->depth - 1].func;
+        cg->node = cg->stack[cg->depth - 1].node;
+    }
+    else
+    {
+        cg->func = SIM65_PROF_NATIVE;
+        cg->node = 0;
+    }
+}
+
+void cg_push(callgraph *cg, uint32_t site, uint32_t callee, uint8_t sp, uint64_t cycles)
+{
+    // Remove frames left by code that discarded its return address
+    cg_return(cg, sp + 1, cycles);
+    push(cg, site, callee, sp, cycles);
+}
+
+void cg_call(callgraph *cg, uint32_t callee, uint8_t sp, uint64_t cycles)
+{
+    cg_push(cg, cg->func, callee, sp, cycles);
+}
+
+void cg_return(callgraph *cg, uint8_t sp, uint64_t cycles)
+{
+    while (cg->depth && cg->stack[cg->depth - 1].sp < sp)
+        pop(cg, cycles);
+}
+
+void cg_add_cycles(callgraph *cg, unsigned cycles)
+{
+    cg->excl[cg->func] += cycles;
+    cg->nodes[cg->node].cycles += cycles;
+}
+
+void cg_sample(callgraph *cg)
+{
+    cg->nodes[cg->node].samples++;
+}
+
+void cg_sample_context(callgraph *cg, const uint32_t *funcs, unsigned num)
+{
+    uint32_t node = 0;
+    while (num)
+        node = get_node(cg, node, funcs[--num]);
+    cg->nodes[node].samples++;
+}
+
+void cg_check_stack(callgraph *cg, uint8_t old_sp, uint8_t sp)
+{
+    // Stack moved down a few bytes, but the value is bigger
+    if (sp > old_sp && (uint8_t)(old_sp - sp) <= 8)
+    {
+        if (!cg->sp_wraps++)
+            cg->sp_wrap_node = cg->node;
+    }
+    if (sp < cg->min_sp)
+    {
+        cg->min_sp      = sp;
+        cg->min_sp_node = cg->node;
+    }
+}
+
+void cg_zp_access(callgraph *cg, uint8_t addr)
+{
+    uint32_t *zp = cg->zp[cg->func];
+    if (!zp)
+    {
+        zp = cg->zp[cg->func] = calloc(8, sizeof(uint32_t));
+        if (!zp)
+            return;
+    }
+    zp[addr >> 5] |= 1U << (addr & 31);
+}
+
+uint32_t cg_native(callgraph *cg, const char *name)
+{
+    for (unsigned i = 0; i < cg->num_names; i++)
+        if (!strcmp(cg->names[i], name))
+            return SIM65_PROF_NATIVE + i;
+    if (cg->num_names >= CG_NATIVE)
+        return SIM65_PROF_NATIVE;
+    cg->names[cg->num_names] = strdup(name);
+    if (!cg->names[cg->num_names])
+        return SIM65_PROF_NATIVE;
+    return SIM65_PROF_NATIVE + cg->num_names++;
+}
+
+void cg_enter(callgraph *cg, uint32_t id, uint8_t sp, uint64_t cycles)
+{
+    push(cg, cg->func, id, sp, cycles);
+}
+
+const char *cg_native_name(const callgraph *cg, uint32_t id)
+{
+    if (id < SIM65_PROF_NATIVE || id - SIM65_PROF_NATIVE >= cg->num_names)
+        return 0;
+    return cg->names[id - SIM65_PROF_NATIVE];
+}
+
+void cg_get_profile(callgraph *cg, struct sim65_call_profile *p)
+{
+    p->max             = SIM65_PROF_NATIVE + cg->num_names;
+    p->calls           = cg->calls;
+    p->incl_cycles     = cg->incl;
+    p->excl_cycles     = cg->excl;
+    p->num_edges       = cg->num_edges;
+    p->edges           = cg->edges;
+    p->num_nodes       = cg->num_nodes;
+    p->nodes           = cg->nodes;
+    p->min_stack       = cg->min_sp;
+    p->min_stack_node  = cg->min_sp_node;
+    p->stack_wraps     = cg->sp_wraps;
+    p->stack_wrap_node = cg->sp_wrap_node;
+    p->zp_used         = (const uint32_t *const *)cg->zp;
+    p->max_call        = cg->max_call;
+    p->max_call_node   = cg->max_call_node;
+    p->budget          = cg->budget;
+    p->over_budget     = cg->over;
+    p->min_call        = cg->min_call;
+    p->ret_calls       = cg->ret_calls;
+    p->ret_cycles      = cg->ret_cycles;
+}
+
+uint64_t cg_call_percentile(const callgraph *cg, uint32_t func, double pct)
+{
+    if (func >= CG_FUNCS || !cg->hist[func])
+        return 0;
+    uint64_t n = 0, target = (uint64_t)(pct / 100.0 * cg->ret_calls[func] + 0.5);
+    if (target < 1)
+        target = 1;
+    for (unsigned b = 0; b < CG_HIST_SIZE; b++)
+    {
+        n += cg->hist[func][b];
+        if (n >= target)
+        {
+            uint64_t v = hist_value(b);
+            if (v > cg->max_call[func])
+                v = cg->max_call[func];
+            return v < cg->min_call[func] ? cg->min_call[func] : v;
+        }
+    }
+    return cg->max_call[func];
+}
+
+void cg_set_budget(callgraph *cg, uint32_t func, uint64_t cycles)
+{
+    if (func < CG_FUNCS)
+        cg->budget[func] = cycles;
+}
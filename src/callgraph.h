@@ -0,0 +1,64 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Call graph profiler: shadow call stack, call edges and calling context tree */
+#pragma once
+
+#include "sim65.h"
+#include <stdint.h>
+
+typedef struct callgraph callgraph;
+
+/// Creates call graph profiler state.
+callgraph *cg_new(void);
+/// Frees call graph profiler state.
+void cg_free(callgraph *cg);
+/// Enters a routine, called from the given call site. "sp" is the stack
+/// pointer after the call, the frame is removed when the stack is above it.
+void cg_push(callgraph *cg, uint32_t site, uint32_t callee, uint8_t sp, uint64_t cycles);
+/// Enters a routine called from native code, the call site is the current routine.
+void cg_call(callgraph *cg, uint32_t callee, uint8_t sp, uint64_t cycles);
+/// Removes all frames of routines that returned, as the stack is above their
+/// return address.
+void cg_return(callgraph *cg, uint8_t sp, uint64_t cycles);
+/// Adds cycles executed to the current routine.
+void cg_add_cycles(callgraph *cg, unsigned cycles);
+/// Adds one sample of the sampling profiler to the current context.
+void cg_sample(callgraph *cg);
+/// Adds one sample to the calling context given by the routines, from the
+/// innermost, without tracking the calls.
+void cg_sample_context(callgraph *cg, const uint32_t *funcs, unsigned num);
+/// Checks the stack pointer after each instruction, to record the deepest
+/// stack and the stack wrapping below $0100.
+void cg_check_stack(callgraph *cg, uint8_t old_sp, uint8_t sp);
+/// Records an access to a zero page location from the current routine.
+void cg_zp_access(callgraph *cg, uint8_t addr);
+/// Returns the id for a native handler frame with the given name.
+uint32_t cg_native(callgraph *cg, const char *name);
+/// Enters a native handler frame, called from current routine. The frame is
+/// removed with the routine frames, when the stack is above "sp".
+void cg_enter(callgraph *cg, uint32_t id, uint8_t sp, uint64_t cycles);
+/// Returns the name of a native frame, or null if the id is not a native frame.
+const char *cg_native_name(const callgraph *cg, uint32_t id);
+/// Sets the maximum cycles of each call to a routine, 0 for no limit.
+void cg_set_budget(callgraph *cg, uint32_t func, uint64_t cycles);
+/// Returns the cycles of a call to a routine at the given percentile, from
+/// the histogram of all returned calls.
+uint64_t cg_call_percentile(const callgraph *cg, uint32_t func, double pct);
+/// Fills the call graph profile information.
+void cg_get_profile(callgraph *cg, struct sim65_call_profile *p);
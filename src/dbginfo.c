@@ -0,0 +1,698 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "dbginfo.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXADDR 0x10000
+
+// Line types in debug info
+enum
+{
+    line_asm   = 0,
+    line_ext   = 1, // C source
+    line_macro = 2
+};
+
+struct dbg_file
+{
+    char *name;
+};
+
+struct dbg_line
+{
+    int file;
+    unsigned line;
+    int type;
+    unsigned span, nspan; // List of spans in the pool
+};
+
+struct dbg_seg
+{
+    unsigned start;
+};
+
+struct dbg_span
+{
+    int seg;
+    unsigned start;
+    unsigned size;
+};
+
+struct dbg_scope
+{
+    char *name;
+    int parent;
+    unsigned size;
+    unsigned span, nspan;
+};
+
+struct dbg_sym
+{
+    char *name;
+    unsigned val;
+    int label;
+};
+
+// Array of records, indexed by id
+struct dbg_array
+{
+    void *data;
+    unsigned num;
+    unsigned max;
+};
+
+struct dbginfo
+{
+    char *dir; // Directory of the debug file, to search the sources
+    struct dbg_array files, lines, segs, spans, scopes, syms;
+    unsigned *pool; // Lists of spans
+    unsigned npool;
+    unsigned mpool;
+    // Maps from address to records, -1 if none
+    int asm_line[MAXADDR];
+    int src_line[MAXADDR];
+    int scope[MAXADDR];
+};
+
+// Returns record with given id, growing the array if needed
+static void *get_rec(struct dbg_array *a, unsigned id, size_t size)
+{
+    if (id > 0xFFFFFF)
+        return 0;
+    if (id >= a->max)
+    {
+        unsigned nmax = a->max ? a->max : 64;
+        while (nmax <= id)
+            nmax *= 2;
+        void *p = realloc(a->data, nmax * size);
+        if (!p)
+            return 0;
+        memset((char *)p + a->max * size, 0, (nmax - a->max) * size);
+        a->data = p;
+        a->max  = nmax;
+    }
+    if (id >= a->num)
+        a->num = id + 1;
+    return (char *)a->data + id * size;
+}
+
+#define REC(a, type, id) ((type *)(a).data + (id))
+
+// Parses next "key=value" field from record, returns 0 at end.
+// Quoted strings are unquoted in place.
+static int next_field(char **p, char **key, char **val)
+{
+    char *s = *p;
+    if (!*s)
+        return 0;
+    *key = s;
+    while (*s && *s != '=' && *s != ',')
+        s++;
+    if (*s != '=')
+    {
+        // Field without value
+        *val = s;
+        if (*s)
+            *s++ = 0;
+        *p = s;
+        return 1;
+    }
+    *s++ = 0;
+    *val = s;
+    if (*s == '"')
+    {
+        char *d = s;
+        for (s++; *s && *s != '"'; s++)
+        {
+            if (*s == '\\' && s[1])
+                s++;
+            *d++ = *s;
+        }
+        if (*s)
+            s++;
+        *d = 0;
+    }
+    else
+    {
+        while (*s && *s != ',')
+            s++;
+    }
+    if (*s)
+        *s++ = 0;
+    *p = s;
+    return 1;
+}
+
+// Parses a list of ids separated by '+' into the pool
+static int parse_list(dbginfo *d, const char *val, unsigned *start, unsigned *num)
+{
+    *start = d->npool;
+    *num   = 0;
+    while (*val)
+    {
+        char *end;
+        unsigned long v = strtoul(val, &end, 0);
+        if (end == val)
+            return 1;
+        if (d->npool >= d->mpool)
+        {
+            unsigned nmax = d->mpool ? d->mpool * 2 : 1024;
+            unsigned *p   = realloc(d->pool, nmax * sizeof(unsigned));
+            if (!p)
+                return 1;
+            d->pool  = p;
+            d->mpool = nmax;
+        }
+        d->pool[d->npool++] = v;
+        (*num)++;
+        val = (*end == '+') ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Parses one record, returns 0 if no error
+static int parse_record(dbginfo *d, char *buf)
+{
+    char *p = buf, *key, *val;
+    while (*p && *p != '\t')
+        p++;
+    if (!*p)
+        return 0;
+    *p++ = 0;
+
+    // Read all fields, only "id" must come first in all records
+    long id = -1;
+    if (!strcmp(buf, "file"))
+    {
+        char *name = 0;
+        while (next_field(&p, &key, &val))
+            if (!strcmp(key, "id"))
+                id = strtol(val, 0, 0);
+            else if (!strcmp(key, "name"))
+                name = val;
+        struct dbg_file *r = id < 0 ? 0 : get_rec(&d->files, id, sizeof(*r));
+        if (!r || !name || !(r->name = strdup(name)))
+            return 1;
+    }
+    else if (!strcmp(buf, "line"))
+    {
+        struct dbg_line l = { -1, 0, line_asm, 0, 0 };
+        while (next_field(&p, &key, &val))
+            if (!strcmp(key, "id"))
+                id = strtol(val, 0, 0);
+            else if (!strcmp(key, "file"))
+                l.file = strtol(val, 0, 0);
+            else if (!strcmp(key, "line"))
+                l.line = strtoul(val, 0, 0);
+            else if (!strcmp(key, "type"))
+                l.type = strtol(val, 0, 0);
+            else if (!strcmp(key, "span") && parse_list(d, val, &l.span, &l.nspan))
+                return 1;
+        struct dbg_line *r = id < 0 ? 0 : get_rec(&d->lines, id, sizeof(*r));
+        if (!r)
+            return 1;
+        *r = l;
+    }
+    else if (!strcmp(buf, "seg"))
+    {
+        unsigned start = 0;
+        while (next_field(&p, &key, &val))
+            if (!strcmp(key, "id"))
+                id = strtol(val, 0, 0);
+            else if (!strcmp(key, "start"))
+                start = strtoul(val, 0, 0);
+        struct dbg_seg *r = id < 0 ? 0 : get_rec(&d->segs, id, sizeof(*r));
+        if (!r)
+            return 1;
+        r->start = start;
+    }
+    else if (!strcmp(buf, "span"))
+    {
+        struct dbg_span sp = { -1, 0, 0 };
+        while (next_field(&p, &key, &val))
+            if (!strcmp(key, "id"))
+                id = strtol(val, 0, 0);
+            else if (!strcmp(key, "seg"))
+                sp.seg = strtol(val, 0, 0);
+            else if (!strcmp(key, "start"))
+                sp.start = strtoul(val, 0, 0);
+            else if (!strcmp(key, "size"))
+                sp.size = strtoul(val, 0, 0);
+        struct dbg_span *r = id < 0 ? 0 : get_rec(&d->spans, id, sizeof(*r));
+        if (!r)
+            return 1;
+        *r = sp;
+    }
+    else if (!strcmp(buf, "scope"))
+    {
+        struct dbg_scope sc = { 0, -1, 0, 0, 0 };
+        char *name          = "";
+        while (next_field(&p, &key, &val))
+            if (!strcmp(key, "id"))
+                id = strtol(val, 0, 0);
+            else if (!strcmp(key, "name"))
+                name = val;
+            else if (!strcmp(key, "parent"))
+                sc.parent = strtol(val, 0, 0);
+            else if (!strcmp(key, "size"))
+                sc.size = strtoul(val, 0, 0);
+            else if (!strcmp(key, "span") && parse_list(d, val, &sc.span, &sc.nspan))
+                return 1;
+        struct dbg_scope *r = id < 0 ? 0 : get_rec(&d->scopes, id, sizeof(*r));
+        if (!r || !(sc.name = strdup(name)))
+            return 1;
+        *r = sc;
+    }
+    else if (!strcmp(buf, "sym"))
+    {
+        struct dbg_sym sy = { 0, 0, 0 };
+        char *name        = 0;
+        while (next_field(&p, &key, &val))
+            if (!strcmp(key, "id"))
+                id = strtol(val, 0, 0);
+            else if (!strcmp(key, "name"))
+                name = val;
+            else if (!strcmp(key, "val"))
+                sy.val = strtoul(val, 0, 0);
+            else if (!strcmp(key, "type"))
+                sy.label = !strcmp(val, "lab");
+        struct dbg_sym *r = id < 0 ? 0 : get_rec(&d->syms, id, sizeof(*r));
+        if (!r || !name || !(sy.name = strdup(name)))
+            return 1;
+        *r = sy;
+    }
+    return 0;
+}
+
+// Assigns the record id to all addresses in a list of spans, if there is no
+// other record there or this one is better
+static void for_spans(dbginfo *d, unsigned span, unsigned nspan, int *map,
+                      int id, int (*better)(dbginfo *, int, int))
+{
+    for (unsigned i = 0; i < nspan; i++)
+    {
+        unsigned sid = d->pool[span + i];
+        if (sid >= d->spans.num)
+            continue;
+        struct dbg_span *sp = REC(d->spans, struct dbg_span, sid);
+        if (sp->seg < 0 || (unsigned)sp->seg >= d->segs.num)
+            continue;
+        unsigned addr = REC(d->segs, struct dbg_seg, sp->seg)->start + sp->start;
+        for (unsigned j = 0; j < sp->size && addr + j < MAXADDR; j++)
+            if (map[addr + j] < 0 || better(d, id, map[addr + j]))
+                map[addr + j] = id;
+    }
+}
+
+// Assembly lines are preferred over macro lines
+static int better_line(dbginfo *d, int a, int b)
+{
+    return REC(d->lines, struct dbg_line, a)->type == line_asm &&
+           REC(d->lines, struct dbg_line, b)->type != line_asm;
+}
+
+// Inner scopes are preferred
+static int better_scope(dbginfo *d, int a, int b)
+{
+    return REC(d->scopes, struct dbg_scope, a)->size < REC(d->scopes, struct dbg_scope, b)->size;
+}
+
+dbginfo *dbginfo_load(const char *fname)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f)
+        return 0;
+
+    char *buf  = 0;
+    size_t len = 0;
+    if (getline(&buf, &len, f) < 0 || strncmp(buf, "version\tmajor=2,", 16))
+    {
+        free(buf);
+        fclose(f);
+        errno = 0;
+        return 0;
+    }
+
+    dbginfo *d = calloc(1, sizeof(dbginfo));
+    if (!d)
+    {
+        free(buf);
+        fclose(f);
+        return 0;
+    }
+    d->dir      = strdup(fname);
+    char *slash = d->dir ? strrchr(d->dir, '/') : 0;
+    if (slash)
+        slash[1] = 0;
+    else if (d->dir)
+        d->dir[0] = 0;
+
+    int err = !d->dir;
+    while (!err && getline(&buf, &len, f) >= 0)
+    {
+        buf[strcspn(buf, "\r\n")] = 0;
+        err = parse_record(d, buf);
+    }
+    free(buf);
+    fclose(f);
+    if (err)
+    {
+        dbginfo_free(d);
+        errno = EINVAL;
+        return 0;
+    }
+
+    // Build address maps
+    for (unsigned i = 0; i < MAXADDR; i++)
+        d->asm_line[i] = d->src_line[i] = d->scope[i] = -1;
+    for (unsigned i = 0; i < d->lines.num; i++)
+    {
+        struct dbg_line *l = REC(d->lines, struct dbg_line, i);
+        for_spans(d, l->span, l->nspan, l->type == line_ext ? d->src_line : d->asm_line,
+                  i, better_line);
+    }
+    for (unsigned i = 0; i < d->scopes.num; i++)
+    {
+        struct dbg_scope *sc = REC(d->scopes, struct dbg_scope, i);
+        for_spans(d, sc->span, sc->nspan, d->scope, i, better_scope);
+    }
+    return d;
+}
+
+void dbginfo_free(dbginfo *d)
+{
+    if (!d)
+        return;
+    for (unsigned i = 0; i < d->files.num; i++)
+        free(REC(d->files, struct dbg_file, i)->name);
+    for (unsigned i = 0; i < d->scopes.num; i++)
+        free(REC(d->scopes, struct dbg_scope, i)->name);
+    for (unsigned i = 0; i < d->syms.num; i++)
+        free(REC(d->syms, struct dbg_sym, i)->name);
+    free(d->files.data);
+    free(d->lines.data);
+    free(d->segs.data);
+    free(d->spans.data);
+    free(d->scopes.data);
+    free(d->syms.data);
+    free(d->pool);
+    free(d->dir);
+    free(d);
+}
+
+void dbginfo_add_labels(const dbginfo *d, sim65 s)
+{
+    for (unsigned i = 0; i < d->syms.num; i++)
+    {
+        const struct dbg_sym *sy = REC(d->syms, struct dbg_sym, i);
+        if (sy->name && sy->label && sy->val < MAXADDR)
+            sim65_lbl_add(s, sy->val, sy->name);
+    }
+}
+
+// Returns the name of a scope, empty for the global scope and for ids missing
+// from the file
+static const char *scope_name(const dbginfo *d, int id)
+{
+    const char *name = REC(d->scopes, struct dbg_scope, id)->name;
+    return name ? name : "";
+}
+
+// Writes full name of scope, with all the parents
+static void print_scope(const dbginfo *d, FILE *f, int id, int depth)
+{
+    const struct dbg_scope *sc = REC(d->scopes, struct dbg_scope, id);
+    if (sc->parent >= 0 && (unsigned)sc->parent < d->scopes.num && depth < 64)
+    {
+        print_scope(d, f, sc->parent, depth + 1);
+        if (scope_name(d, sc->parent)[0])
+            fputs("::", f);
+    }
+    fputs(scope_name(d, id), f);
+}
+
+// Opens a source file, searching also in the directory of the debug file
+static FILE *open_source(const dbginfo *d, const char *name)
+{
+    FILE *f = fopen(name, "r");
+    if (f || name[0] == '/' || !d->dir[0])
+        return f;
+    char *path = malloc(strlen(d->dir) + strlen(name) + 1);
+    if (!path)
+        return 0;
+    strcpy(path, d->dir);
+    strcat(path, name);
+    f = fopen(path, "r");
+    free(path);
+    return f;
+}
+
+static const uint64_t *sort_cycles;
+static int cmp_cycles(const void *a, const void *b)
+{
+    uint64_t ca = sort_cycles[*(const unsigned *)a];
+    uint64_t cb = sort_cycles[*(const unsigned *)b];
+    return (ca < cb) - (ca > cb);
+}
+
+void dbginfo_store_profile(const dbginfo *d, FILE *f, const uint64_t *cycles)
+{
+    uint64_t total = 0, max = 1000;
+    for (unsigned i = 0; i < MAXADDR; i++)
+    {
+        total += cycles[i];
+        if (cycles[i] > max)
+            max = cycles[i];
+    }
+    if (!total)
+        return;
+    int digits = 0;
+    for (; max; max /= 10)
+        digits++;
+
+    // Cycles per scope, sorted
+    uint64_t *sc_cyc = calloc(d->scopes.num + 1, sizeof(uint64_t));
+    uint64_t *ln_cyc = calloc(d->lines.num + 1, sizeof(uint64_t));
+    unsigned *idx    = calloc(d->scopes.num + 1, sizeof(unsigned));
+    if (!sc_cyc || !ln_cyc || !idx)
+    {
+        free(sc_cyc);
+        free(ln_cyc);
+        free(idx);
+        return;
+    }
+    for (unsigned i = 0; i < MAXADDR; i++)
+    {
+        if (!cycles[i])
+            continue;
+        if (d->scope[i] >= 0)
+            sc_cyc[d->scope[i]] += cycles[i];
+        if (d->asm_line[i] >= 0)
+            ln_cyc[d->asm_line[i]] += cycles[i];
+        if (d->src_line[i] >= 0)
+            ln_cyc[d->src_line[i]] += cycles[i];
+    }
+    unsigned num = 0;
+    for (unsigned i = 0; i < d->scopes.num; i++)
+        if (sc_cyc[i])
+            idx[num++] = i;
+    sort_cycles = sc_cyc;
+    qsort(idx, num, sizeof(unsigned), cmp_cycles);
+    fprintf(f, "--------- Scopes: cycles\n");
+    for (unsigned i = 0; i < num; i++)
+    {
+        fprintf(f, "%*" PRIu64 " %5.1f%% ", digits, sc_cyc[idx[i]],
+                100.0 * sc_cyc[idx[i]] / total);
+        if (scope_name(d, idx[i])[0])
+            print_scope(d, f, idx[i], 0);
+        else
+            fputs("(global)", f);
+        fputc('\n', f);
+    }
+
+    // Annotated sources, for each file with cycles
+    for (unsigned fid = 0; fid < d->files.num; fid++)
+    {
+        const struct dbg_file *df = REC(d->files, struct dbg_file, fid);
+        unsigned max_line         = 0;
+        for (unsigned i = 0; i < d->lines.num; i++)
+        {
+            const struct dbg_line *l = REC(d->lines, struct dbg_line, i);
+            if (l->file == (int)fid && ln_cyc[i] && l->line > max_line)
+                max_line = l->line;
+        }
+        if (!max_line || !df->name)
+            continue;
+        uint64_t *fc = calloc(max_line + 1, sizeof(uint64_t));
+        if (!fc)
+            break;
+        for (unsigned i = 0; i < d->lines.num; i++)
+        {
+            const struct dbg_line *l = REC(d->lines, struct dbg_line, i);
+            if (l->file == (int)fid && l->line <= max_line)
+                fc[l->line] += ln_cyc[i];
+        }
+
+        fprintf(f, "--------- Source: %s\n", df->name);
+        FILE *src = open_source(d, df->name);
+        if (src)
+        {
+            char *buf  = 0;
+            size_t len = 0;
+            for (unsigned ln = 1; getline(&buf, &len, src) >= 0; ln++)
+            {
+                buf[strcspn(buf, "\r\n")] = 0;
+                if (ln <= max_line && fc[ln])
+                    fprintf(f, "%*" PRIu64 " %5.1f%% %5u: %s\n", digits, fc[ln],
+                            100.0 * fc[ln] / total, ln, buf);
+                else
+                    fprintf(f, "%*s        %5u: %s\n", digits, "", ln, buf);
+            }
+            free(buf);
+            fclose(src);
+        }
+        else
+        {
+            // No source, write only the lines with cycles
+            for (unsigned ln = 1; ln <= max_line; ln++)
+                if (fc[ln])
+                    fprintf(f, "%*" PRIu64 " %5.1f%% %5u\n", digits, fc[ln],
+                            100.0 * fc[ln] / total, ln);
+        }
+        free(fc);
+    }
+    free(idx);
+    free(ln_cyc);
+    free(sc_cyc);
+}
+
+// Returns the lowest address in a list of spans, and if any was executed
+static unsigned span_cover(const dbginfo *d, unsigned span, unsigned nspan,
+                           const uint8_t *cov, int *hit)
+{
+    unsigned min = MAXADDR;
+    *hit         = 0;
+    for (unsigned i = 0; i < nspan; i++)
+    {
+        unsigned sid = d->pool[span + i];
+        if (sid >= d->spans.num)
+            continue;
+        const struct dbg_span *sp = REC(d->spans, struct dbg_span, sid);
+        if (sp->seg < 0 || (unsigned)sp->seg >= d->segs.num)
+            continue;
+        unsigned addr = REC(d->segs, struct dbg_seg, sp->seg)->start + sp->start;
+        if (addr < min)
+            min = addr;
+        for (unsigned j = 0; j < sp->size && addr + j < MAXADDR; j++)
+            if (cov[addr + j] & (sim65_cov_next | sim65_cov_jump))
+                *hit = 1;
+    }
+    return min;
+}
+
+// Returns the line in the given file of an address, 0 if none
+static unsigned addr_line(const dbginfo *d, unsigned addr, int fid)
+{
+    int ids[2] = { d->asm_line[addr], d->src_line[addr] };
+    for (int i = 0; i < 2; i++)
+        if (ids[i] >= 0 && REC(d->lines, struct dbg_line, ids[i])->file == fid)
+            return REC(d->lines, struct dbg_line, ids[i])->line;
+    return 0;
+}
+
+void dbginfo_store_lcov(const dbginfo *d, FILE *f, const uint8_t *cov)
+{
+    for (unsigned fid = 0; fid < d->files.num; fid++)
+    {
+        const struct dbg_file *df = REC(d->files, struct dbg_file, fid);
+        unsigned max_line         = 0;
+        for (unsigned i = 0; i < d->lines.num; i++)
+        {
+            const struct dbg_line *l = REC(d->lines, struct dbg_line, i);
+            if (l->file == (int)fid && l->nspan && l->line > max_line)
+                max_line = l->line;
+        }
+        if (!max_line || !df->name)
+            continue;
+        // Line state: 0 no code, 1 not executed, 2 executed
+        uint8_t *ls = calloc(max_line + 1, 1);
+        if (!ls)
+            break;
+        for (unsigned i = 0; i < d->lines.num; i++)
+        {
+            const struct dbg_line *l = REC(d->lines, struct dbg_line, i);
+            int hit;
+            if (l->file != (int)fid || !l->nspan)
+                continue;
+            if (span_cover(d, l->span, l->nspan, cov, &hit) < MAXADDR && ls[l->line] < 1 + hit)
+                ls[l->line] = 1 + hit;
+        }
+
+        fprintf(f, "TN:\nSF:%s%s\n", df->name[0] == '/' ? "" : d->dir, df->name);
+        // Functions are the named scopes starting in this file
+        unsigned fnf = 0, fnh = 0;
+        for (unsigned i = 0; i < d->scopes.num; i++)
+        {
+            const struct dbg_scope *sc = REC(d->scopes, struct dbg_scope, i);
+            int hit;
+            if (!scope_name(d, i)[0])
+                continue;
+            unsigned addr = span_cover(d, sc->span, sc->nspan, cov, &hit);
+            unsigned ln   = addr < MAXADDR ? addr_line(d, addr, fid) : 0;
+            if (!ln)
+                continue;
+            fprintf(f, "FN:%u,", ln);
+            print_scope(d, f, i, 0);
+            fprintf(f, "\nFNDA:%d,", hit);
+            print_scope(d, f, i, 0);
+            fputc('\n', f);
+            fnf++;
+            fnh += hit;
+        }
+        fprintf(f, "FNF:%u\nFNH:%u\n", fnf, fnh);
+
+        // Both directions of each executed branch
+        unsigned brf = 0, brh = 0;
+        for (unsigned addr = 0; addr < MAXADDR; addr++)
+        {
+            unsigned ln = (cov[addr] & sim65_cov_branch) ? addr_line(d, addr, fid) : 0;
+            if (!ln)
+                continue;
+            int nt = !!(cov[addr] & sim65_cov_next), tk = !!(cov[addr] & sim65_cov_jump);
+            fprintf(f, "BRDA:%u,%u,0,%d\nBRDA:%u,%u,1,%d\n", ln, addr, nt, ln, addr, tk);
+            brf += 2;
+            brh += nt + tk;
+        }
+        fprintf(f, "BRF:%u\nBRH:%u\n", brf, brh);
+
+        unsigned lf = 0, lh = 0;
+        for (unsigned ln = 1; ln <= max_line; ln++)
+            if (ls[ln])
+            {
+                fprintf(f, "DA:%u,%d\n", ln, ls[ln] - 1);
+                lf++;
+                lh += ls[ln] - 1;
+            }
+        fprintf(f, "LF:%u\nLH:%u\nend_of_record\n", lf, lh);
+        free(ls);
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Debug information files from the cc65 linker (ld65 --dbgfile) */
+#pragma once
+
+#include "sim65.h"
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct dbginfo dbginfo;
+
+/// Reads a debug information file written by ld65.
+/// @returns null on error, with errno set to 0 if the file is not a debug
+///          information file.
+dbginfo *dbginfo_load(const char *fname);
+/// Frees debug information.
+void dbginfo_free(dbginfo *d);
+/// Adds all the label symbols to the simulator labels.
+void dbginfo_add_labels(const dbginfo *d, sim65 s);
+/// Writes the profile aggregated by scope and by source line, and the
+/// source files annotated with the cycles of each line.
+/// @param cycles cycles executed by the instruction at each address.
+void dbginfo_store_profile(const dbginfo *d, FILE *f, const uint64_t *cycles);
+/// Writes the code coverage in lcov tracefile format, with the lines and
+/// named scopes of each source file.
+/// @param cov coverage flags of each address, from sim65_get_coverage.
+void dbginfo_store_lcov(const dbginfo *d, FILE *f, const uint8_t *cov);
@@ -0,0 +1,228 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Data flow analysis.
+ *
+ * A store is dead if the location is written again before any read, for
+ * this each memory location holds the last instruction that wrote it and
+ * the "epoch" of the write; native code can read any location, so each
+ * call to native code starts a new epoch and all pending writes are kept.
+ *
+ * A load is redundant if the register already holds the value loaded from
+ * the same memory location or immediate, for this each register holds the
+ * source of its value, cleared when the value changes by other means or
+ * the memory location is written.
+ */
+
+#include "dflow.h"
+#include <stdlib.h>
+
+// Source of a register value: none, memory location or immediate value
+#define SRC_NONE   0
+#define SRC_MEM(a) ((a) + 1U)
+#define SRC_IMM(v) ((v) + 0x10001U)
+
+// Maximum memory accesses of one instruction: BRK pushes three bytes and
+// reads the vector.
+#define MAX_ACCESS 4
+
+enum
+{
+    reg_a,
+    reg_x,
+    reg_y,
+    reg_none
+};
+
+struct dflow
+{
+    uint16_t writer[0x10000]; // Last instruction writing to each location
+    uint8_t wcyc[0x10000];    // Cycles of that instruction
+    uint32_t wepoch[0x10000]; // Epoch of the write, 0 if it was read
+    uint32_t epoch;
+    // Accesses of the current instruction
+    uint16_t reads[MAX_ACCESS];
+    uint16_t writes[MAX_ACCESS];
+    unsigned nreads;
+    unsigned nwrites;
+    // Source and value of A, X and Y
+    uint32_t src[3];
+    uint8_t val[3];
+    uint64_t dead[0x10000];
+    uint64_t dead_cycles[0x10000];
+    uint64_t redundant[0x10000];
+    uint64_t redundant_cycles[0x10000];
+};
+
+dflow *dflow_new(void)
+{
+    dflow *d = calloc(1, sizeof(struct dflow));
+    if (d)
+        d->epoch = 1;
+    return d;
+}
+
+void dflow_free(dflow *d)
+{
+    free(d);
+}
+
+void dflow_read(dflow *d, uint16_t addr)
+{
+    if (d->nreads < MAX_ACCESS)
+        d->reads[d->nreads] = addr;
+    d->nreads++;
+}
+
+void dflow_write(dflow *d, uint16_t addr)
+{
+    if (d->nwrites < MAX_ACCESS)
+        d->writes[d->nwrites++] = addr;
+}
+
+void dflow_native(dflow *d)
+{
+    d->epoch++;
+    for (int i = 0; i < 3; i++)
+        d->src[i] = SRC_NONE;
+}
+
+// Returns the register loaded by the instruction, from memory or immediate.
+static int load_reg(uint8_t ins)
+{
+    switch (ins)
+    {
+        case 0xA1: case 0xA5: case 0xA9: case 0xAD:
+        case 0xB1: case 0xB5: case 0xB9: case 0xBD:
+            return reg_a;
+        case 0xA2: case 0xA6: case 0xAE: case 0xB6: case 0xBE:
+            return reg_x;
+        case 0xA0: case 0xA4: case 0xAC: case 0xB4: case 0xBC:
+            return reg_y;
+        default:
+            return reg_none;
+    }
+}
+
+// Returns the register stored by the instruction.
+static int store_reg(uint8_t ins)
+{
+    switch (ins)
+    {
+        case 0x81: case 0x85: case 0x8D: case 0x91:
+        case 0x95: case 0x99: case 0x9D:
+            return reg_a;
+        case 0x86: case 0x8E: case 0x96:
+            return reg_x;
+        case 0x84: case 0x8C: case 0x94:
+            return reg_y;
+        default:
+            return reg_none;
+    }
+}
+
+// Copies the source of a register on transfer instructions, a transfer
+// between registers with the same source is also redundant.
+static int transfer(dflow *d, uint8_t ins)
+{
+    int from, to;
+    switch (ins)
+    {
+        case 0xAA: from = reg_a, to = reg_x; break;
+        case 0xA8: from = reg_a, to = reg_y; break;
+        case 0x8A: from = reg_x, to = reg_a; break;
+        case 0x98: from = reg_y, to = reg_a; break;
+        default: return -1;
+    }
+    int ret    = d->src[from] != SRC_NONE && d->src[from] == d->src[to];
+    d->src[to] = d->src[from];
+    return ret;
+}
+
+void dflow_step(dflow *d, uint16_t pc, uint8_t ins, const struct sim65_reg *old,
+                const struct sim65_reg *r, unsigned cyc)
+{
+    const uint8_t ov[3] = { old->a, old->x, old->y };
+    const uint8_t nv[3] = { r->a, r->x, r->y };
+
+    // Discard sources of registers changed outside of the tracked instructions
+    for (int i = 0; i < 3; i++)
+        if (ov[i] != d->val[i])
+            d->src[i] = SRC_NONE;
+
+    // Reads consume the pending writes, in the order of the instruction
+    for (unsigned i = 0; i < d->nreads && i < MAX_ACCESS; i++)
+        d->wepoch[d->reads[i]] = 0;
+    for (unsigned i = 0; i < d->nwrites; i++)
+    {
+        uint16_t addr = d->writes[i];
+        if (d->wepoch[addr] == d->epoch)
+        {
+            d->dead[d->writer[addr]]++;
+            d->dead_cycles[d->writer[addr]] += d->wcyc[addr];
+        }
+        d->writer[addr] = pc;
+        d->wcyc[addr]   = cyc > 0xFF ? 0xFF : cyc;
+        d->wepoch[addr] = d->epoch;
+        for (int j = 0; j < 3; j++)
+            if (d->src[j] == SRC_MEM(addr))
+                d->src[j] = SRC_NONE;
+    }
+
+    int reg = load_reg(ins), red = 0;
+    if (reg != reg_none)
+    {
+        // Loads from memory use the last read, I/O locations are not recorded.
+        // The flags are not considered, the load could be needed to set them.
+        uint32_t src = SRC_NONE;
+        if (ins == 0xA9 || ins == 0xA2 || ins == 0xA0)
+            src = SRC_IMM(nv[reg]);
+        else if (d->nreads && d->nreads <= MAX_ACCESS)
+            src = SRC_MEM(d->reads[d->nreads - 1]);
+        red         = src != SRC_NONE && src == d->src[reg] && ov[reg] == nv[reg];
+        d->src[reg] = src;
+    }
+    else if ((reg = store_reg(ins)) != reg_none)
+    {
+        if (d->nwrites)
+            d->src[reg] = SRC_MEM(d->writes[d->nwrites - 1]);
+    }
+    else if ((red = transfer(d, ins)) < 0)
+    {
+        // Other instructions, discard the source of modified registers
+        red = 0;
+        for (int i = 0; i < 3; i++)
+            if (ov[i] != nv[i])
+                d->src[i] = SRC_NONE;
+    }
+    if (red)
+    {
+        d->redundant[pc]++;
+        d->redundant_cycles[pc] += cyc;
+    }
+    for (int i = 0; i < 3; i++)
+        d->val[i] = nv[i];
+    d->nreads  = 0;
+    d->nwrites = 0;
+}
+
+struct sim65_dataflow dflow_get(const dflow *d)
+{
+    struct sim65_dataflow r = { d->dead, d->dead_cycles, d->redundant, d->redundant_cycles };
+    return r;
+}
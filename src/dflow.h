@@ -0,0 +1,42 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Data flow analysis: dead stores and redundant loads */
+#pragma once
+
+#include "sim65.h"
+#include <stdint.h>
+
+typedef struct dflow dflow;
+
+/// Creates data flow analysis state.
+dflow *dflow_new(void);
+/// Frees data flow analysis state.
+void dflow_free(dflow *d);
+/// Records a read of memory by the current instruction.
+void dflow_read(dflow *d, uint16_t addr);
+/// Records a write to memory by the current instruction.
+void dflow_write(dflow *d, uint16_t addr);
+/// Records a call to native code, that can read any memory location.
+void dflow_native(dflow *d);
+/// Processes one executed instruction at "pc", with the registers before
+/// and after the execution and the instruction cycles.
+void dflow_step(dflow *d, uint16_t pc, uint8_t ins, const struct sim65_reg *old,
+                const struct sim65_reg *r, unsigned cyc);
+/// Returns the dead store and redundant load counts.
+struct sim65_dataflow dflow_get(const dflow *d);
@@ -17,6 +17,7 @@
  */
 #include "hw.h"
 #include "atari.h"
+#include "journal.h"
 #include "sim65.h"
 #include <math.h>
 #include <stdint.h>
@@ -72,7 +73,13 @@ static int sim_pokey(sim65 s, struct sim65_reg *regs, unsigned addr, int data)
     {
         if (addr == 0xD20A)
         {
-            return 0xFF & rand32();
+            int64_t r;
+            if (!journal_get(journal_random, &r))
+            {
+                r = 0xFF & rand32();
+                journal_put(journal_random, r);
+            }
+            return r;
         }
         sim65_dprintf(s, "POKEY read $%04x", addr);
     }
@@ -136,6 +143,9 @@ static int64_t atari_hw_vcount(sim65 s, int flags)
     }
     else
     {
+        int64_t vcount;
+        if (journal_get(journal_vcount, &vcount))
+            return vcount;
         // Get current time in seconds:
         struct timeval tv;
         gettimeofday(&tv, 0);
@@ -146,9 +156,11 @@ static int64_t atari_hw_vcount(sim65 s, int flags)
         else
             time = time * (15699.75 * 0.5); // NTSC
         if (sizeof(long) == sizeof(int64_t))
-            return lrint(time);
+            vcount = lrint(time);
         else
-            return llrint(time);
+            vcount = llrint(time);
+        journal_put(journal_vcount, vcount);
+        return vcount;
     }
 }
 
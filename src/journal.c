@@ -0,0 +1,274 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Journal of nondeterministic inputs.
+ *
+ * The file is a header line followed by one entry for each value read from
+ * the host:
+ *   varint cycle delta, u8 source,
+ *   varint zig-zag encoded difference to the last value of the same source.
+ *
+ * When the simulation can be rewound, the values are also kept in memory
+ * and given back while re-executing from a checkpoint.
+ */
+#include "journal.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC "SIM65:JOURNAL:1\n"
+#define JOURNAL_SRCS  5
+
+struct jfile
+{
+    FILE *f;
+    uint64_t cycles;
+    int64_t last[JOURNAL_SRCS];
+};
+
+static sim65 jnl_sim;
+static struct jfile jrec, jplay;
+
+// Next entry to replay
+static uint64_t next_cycles;
+static int next_src;
+static int64_t next_value;
+
+// Values kept in memory
+struct jentry
+{
+    uint64_t cycles;
+    int64_t value;
+    int src;
+};
+static struct jentry *jmem;
+static size_t jmem_len, jmem_size, jmem_pos;
+static int jmem_on;
+
+static const char *src_name(int src)
+{
+    static const char *names[JOURNAL_SRCS] = {
+        "unknown", "VCOUNT", "RANDOM", "get char", "peek char"
+    };
+    return names[(src > 0 && src < JOURNAL_SRCS) ? src : 0];
+}
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        putc(v | 0x80, f);
+        v >>= 7;
+    }
+    putc(v, f);
+}
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+    *v = 0;
+    for (int sh = 0; sh < 64; sh += 7)
+    {
+        int c = getc(f);
+        if (c == EOF)
+            return 0;
+        *v |= (uint64_t)(c & 0x7F) << sh;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+static void jfile_close(struct jfile *j)
+{
+    if (j->f)
+        fclose(j->f);
+    memset(j, 0, sizeof(*j));
+}
+
+// Reads next entry from the replay file, closes the file at the end
+static void read_next(void)
+{
+    uint64_t delta, diff;
+    int src = 0;
+    if (!get_varint(jplay.f, &delta) || EOF == (src = getc(jplay.f)) ||
+        src <= 0 || src >= JOURNAL_SRCS || !get_varint(jplay.f, &diff))
+    {
+        if (!feof(jplay.f) || src)
+            sim65_eprintf(jnl_sim, "journal: invalid replay file");
+        else
+            sim65_dprintf(jnl_sim, "journal: end of replay");
+        jfile_close(&jplay);
+        return;
+    }
+    jplay.cycles += delta;
+    jplay.last[src] += (int64_t)((diff >> 1) ^ -(diff & 1));
+    next_cycles = jplay.cycles;
+    next_src    = src;
+    next_value  = jplay.last[src];
+}
+
+int journal_record(sim65 s, const char *fname)
+{
+    jfile_close(&jrec);
+    jnl_sim = s;
+    jrec.f  = fopen(fname, "wb");
+    if (!jrec.f)
+        return 1;
+    fputs(JOURNAL_MAGIC, jrec.f);
+    return 0;
+}
+
+int journal_replay(sim65 s, const char *fname)
+{
+    char magic[sizeof(JOURNAL_MAGIC)];
+    jfile_close(&jplay);
+    jnl_sim = s;
+    jplay.f = fopen(fname, "rb");
+    if (!jplay.f)
+        return 1;
+    if (!fgets(magic, sizeof(magic), jplay.f) || strcmp(magic, JOURNAL_MAGIC))
+    {
+        jfile_close(&jplay);
+        return 1;
+    }
+    read_next();
+    return 0;
+}
+
+void journal_keep(sim65 s)
+{
+    jnl_sim = s;
+    jmem_on = 1;
+}
+
+// Adds a value to the in-memory journal, removing values before the oldest
+// checkpoint when full
+static void jmem_put(enum journal_src src, int64_t value, uint64_t cycles)
+{
+    if (jmem_len == jmem_size)
+    {
+        uint64_t start = sim65_get_checkpoint_start(jnl_sim);
+        size_t n       = 0;
+        while (n < jmem_len && jmem[n].cycles < start)
+            n++;
+        memmove(jmem, jmem + n, (jmem_len - n) * sizeof(*jmem));
+        jmem_len -= n;
+        if (jmem_len >= jmem_size / 2)
+        {
+            size_t size       = jmem_size * 2 + 1024;
+            struct jentry *nj = realloc(jmem, size * sizeof(*jmem));
+            if (!nj)
+            {
+                sim65_eprintf(jnl_sim, "journal: out of memory");
+                jmem_on = 0;
+                return;
+            }
+            jmem      = nj;
+            jmem_size = size;
+        }
+    }
+    jmem[jmem_len].cycles = cycles;
+    jmem[jmem_len].value  = value;
+    jmem[jmem_len].src    = src;
+    jmem_len++;
+}
+
+// Gets a value from the in-memory journal while re-executing
+static int jmem_get(enum journal_src src, int64_t *value)
+{
+    uint64_t cycles = sim65_get_cycles(jnl_sim);
+    // Search from the last position, or from the start on rewind
+    if (jmem_pos >= jmem_len || jmem[jmem_pos].cycles > cycles ||
+        (jmem_pos && jmem[jmem_pos - 1].cycles >= cycles))
+    {
+        size_t a = 0, b = jmem_len;
+        while (a < b)
+        {
+            size_t m = (a + b) / 2;
+            if (jmem[m].cycles < cycles)
+                a = m + 1;
+            else
+                b = m;
+        }
+        jmem_pos = a;
+    }
+    for (size_t i = jmem_pos; i < jmem_len && jmem[i].cycles == cycles; i++)
+    {
+        if (jmem[i].src == src)
+        {
+            *value   = jmem[i].value;
+            jmem_pos = i + 1;
+            return 1;
+        }
+    }
+    sim65_eprintf(jnl_sim, "journal: no %s value at cycle %" PRIu64 " while rewinding",
+                  src_name(src), cycles);
+    return 0;
+}
+
+void journal_close(void)
+{
+    if (jrec.f && ferror(jrec.f))
+        sim65_eprintf(jnl_sim, "journal: error writing file");
+    jfile_close(&jrec);
+    jfile_close(&jplay);
+    free(jmem);
+    jmem     = 0;
+    jmem_len = jmem_size = jmem_pos = 0;
+    jmem_on  = 0;
+}
+
+int journal_get(enum journal_src src, int64_t *value)
+{
+    if (jmem_on && sim65_is_rewinding(jnl_sim))
+        return jmem_get(src, value);
+    if (!jplay.f)
+        return 0;
+    uint64_t cycles = sim65_get_cycles(jnl_sim);
+    if (src != next_src || cycles != next_cycles)
+    {
+        sim65_eprintf(jnl_sim, "journal: replay diverged, %s at cycle %" PRIu64
+                               ", expected %s at cycle %" PRIu64,
+                      src_name(src), cycles, src_name(next_src), next_cycles);
+        jfile_close(&jplay);
+        return 0;
+    }
+    *value = next_value;
+    read_next();
+    // Also store into the new journal
+    journal_put(src, *value);
+    return 1;
+}
+
+void journal_put(enum journal_src src, int64_t value)
+{
+    if (!jnl_sim || sim65_is_rewinding(jnl_sim))
+        return;
+    uint64_t cycles = sim65_get_cycles(jnl_sim);
+    if (jmem_on)
+        jmem_put(src, value, cycles);
+    if (!jrec.f)
+        return;
+    uint64_t diff   = value - jrec.last[src];
+    put_varint(jrec.f, cycles - jrec.cycles);
+    putc(src, jrec.f);
+    put_varint(jrec.f, (diff << 1) ^ -(diff >> 63));
+    jrec.cycles    = cycles;
+    jrec.last[src] = value;
+}
@@ -0,0 +1,45 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+#pragma once
+
+#include "sim65.h"
+
+// Sources of nondeterministic values
+enum journal_src
+{
+    journal_vcount    = 1, // Real time scan-line counter
+    journal_random    = 2, // POKEY random number generator
+    journal_get_char  = 3, // Character read from standard input
+    journal_peek_char = 4  // Character available from standard input
+};
+
+// Starts recording all nondeterministic inputs to the file
+int journal_record(sim65 s, const char *fname);
+// Starts replaying the inputs from a recorded file
+int journal_replay(sim65 s, const char *fname);
+// Keeps the values in memory since the oldest simulator checkpoint, so they
+// are replayed when the simulation is rewound
+void journal_keep(sim65 s);
+// Finish recording and replaying, closing the files
+void journal_close(void);
+// Gets the next value of the given source from the journal being replayed.
+// Returns 1 if the value was replayed, 0 if the value must be read from
+// the host and then added with journal_put.
+int journal_get(enum journal_src src, int64_t *value);
+// Adds a value read from the host to the journal being recorded
+void journal_put(enum journal_src src, int64_t value);
@@ -0,0 +1,172 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Loop profiler.
+ *
+ * A loop is identified by its head, the target of a backward branch, the
+ * "tail". Each time a tail branches to the head is one more iteration. A
+ * run of the loop starts when the head is reached from other place, or with
+ * the first backward branch if the code enters the loop in the middle (as in
+ * loops with the condition at the end), and ends when the tail branch is
+ * not taken or on the next start of the loop. Backward jumps are not loops,
+ * as those are also tail calls to other routines.
+ */
+
+#include "loops.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct loop_run
+{
+    int active;
+    uint64_t iterations;
+    uint64_t start;
+    uint64_t last; // Cycles of the last iteration
+};
+
+struct loops
+{
+    const uint64_t *count;
+    uint32_t head[0x10000]; // Loop index plus one of each loop head
+    uint32_t tail[0x10000]; // Loop index plus one of each backward branch
+    uint64_t reach[0x10000]; // Cycles when each address was last reached
+    struct sim65_loop *list;
+    struct loop_run *run;
+    unsigned num;
+    unsigned max;
+};
+
+loops *loops_new(const uint64_t *count)
+{
+    loops *l = calloc(1, sizeof(struct loops));
+    if (l)
+        l->count = count;
+    return l;
+}
+
+void loops_free(loops *l)
+{
+    if (!l)
+        return;
+    free(l->list);
+    free(l->run);
+    free(l);
+}
+
+static uint32_t new_loop(loops *l, uint16_t head)
+{
+    if (l->num == l->max)
+    {
+        unsigned nmax           = l->max ? l->max * 2 : 64;
+        struct sim65_loop *list = realloc(l->list, nmax * sizeof(*list));
+        struct loop_run *run    = list ? realloc(l->run, nmax * sizeof(*run)) : 0;
+        if (list)
+            l->list = list;
+        if (!run)
+            return 0;
+        l->run = run;
+        l->max = nmax;
+    }
+    memset(&l->list[l->num], 0, sizeof(l->list[0]));
+    memset(&l->run[l->num], 0, sizeof(l->run[0]));
+    l->list[l->num].head = head;
+    l->list[l->num].tail = head;
+    l->head[head]        = ++l->num;
+    return l->num;
+}
+
+static void end_run(loops *l, unsigned i, uint64_t cycles)
+{
+    struct loop_run *r = &l->run[i];
+    if (!r->active)
+        return;
+    struct sim65_loop *lp = &l->list[i];
+    unsigned b            = 63 - __builtin_clzll(r->iterations);
+    lp->runs++;
+    lp->iterations += r->iterations;
+    lp->cycles += cycles - r->start;
+    lp->trips[b < SIM65_LOOP_TRIPS ? b : SIM65_LOOP_TRIPS - 1]++;
+    if (r->iterations > lp->max_trips)
+        lp->max_trips = r->iterations;
+    r->active = 0;
+}
+
+static void start_run(loops *l, unsigned i, uint64_t cycles)
+{
+    struct loop_run *r = &l->run[i];
+    r->active          = 1;
+    r->iterations      = 1;
+    r->start           = cycles;
+    r->last            = cycles;
+}
+
+void loops_step(loops *l, uint16_t pc, uint16_t next, uint8_t ins, uint64_t cycles)
+{
+    int branch     = (ins & 0x1F) == 0x10;
+    uint64_t reach = l->reach[next];
+    l->reach[next] = cycles;
+    if (branch && next <= pc)
+    {
+        // Backward branch: next iteration
+        uint32_t n = l->head[next];
+        if (!n)
+        {
+            if (!(n = new_loop(l, next)))
+                return;
+            // If the head was already executed, this is the second iteration,
+            // the first one started when the head was last reached.
+            if (l->count[next])
+            {
+                start_run(l, n - 1, reach);
+                l->run[n - 1].iterations++;
+                l->run[n - 1].last = cycles;
+            }
+            else
+                start_run(l, n - 1, cycles);
+        }
+        else if (!l->run[n - 1].active)
+            start_run(l, n - 1, cycles);
+        else
+        {
+            l->run[n - 1].iterations++;
+            l->run[n - 1].last = cycles;
+        }
+        l->tail[pc] = n;
+        if (pc > l->list[n - 1].tail)
+            l->list[n - 1].tail = pc;
+        return;
+    }
+    // Tail branch not taken: loop ends
+    if (branch && l->tail[pc])
+        end_run(l, l->tail[pc] - 1, cycles);
+    // Head reached from outside: new run
+    if (l->head[next])
+    {
+        unsigned i = l->head[next] - 1;
+        end_run(l, i, l->run[i].last);
+        start_run(l, i, cycles);
+    }
+}
+
+unsigned loops_get(loops *l, const struct sim65_loop **list)
+{
+    for (unsigned i = 0; i < l->num; i++)
+        end_run(l, i, l->run[i].last);
+    *list = l->list;
+    return l->num;
+}
@@ -0,0 +1,37 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Loop profiler: finds loops from the backward branches and measures each run */
+#pragma once
+
+#include "sim65.h"
+#include <stdint.h>
+
+typedef struct loops loops;
+
+/// Creates loop profiler state, "count" is the number of executions of the
+/// instruction at each address.
+loops *loops_new(const uint64_t *count);
+/// Frees loop profiler state.
+void loops_free(loops *l);
+/// Processes one executed instruction, from "pc" to "next", with the cycles
+/// after the execution.
+void loops_step(loops *l, uint16_t pc, uint16_t next, uint8_t ins, uint64_t cycles);
+/// Ends the current run of all loops, and returns the loop list.
+/// @returns the number of loops.
+unsigned loops_get(loops *l, const struct sim65_loop **list);
@@ -16,9 +16,14 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "atari.h"
+#include "dbginfo.h"
+#include "journal.h"
 #include "sim65.h"
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <math.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -27,6 +32,7 @@
 
 static char *prog_name;
 static FILE *trace_file;
+static dbginfo *dbg_info;
 
 static void print_help(void)
 {
@@ -43,12 +49,48 @@ static void print_help(void)
                     "            If no executable is given, boots from this image.\n"
                     " -e <lvl> : Sets the error level to 'none', 'mem' or 'full'\n"
                     " -t <file>: Store simulation trace into file\n"
+                    " -T <file>: Store binary simulation trace into file, use 'sim65trace'\n"
+                    "            to convert to text.\n"
+                    " -w <win> : Limit the trace to a window, see below.\n"
+                    " -m <file>: Store memory access trace into file, use 'sim65trace -m'\n"
+                    "            to convert to text.\n"
+                    " -M <range>: Adds an address range to the memory access trace, as\n"
+                    "            'start-end' or 'start', with addresses or labels.\n"
+                    " -j <file>: Record all nondeterministic inputs (time, random numbers\n"
+                    "            and keyboard) into a journal file.\n"
+                    " -J <file>: Replay the inputs from a journal file, reproducing a\n"
+                    "            recorded run exactly.\n"
+                    " -k <num>[,<mb>]: Store a checkpoint of the simulation each <num>\n"
+                    "            cycles, using up to <mb> megabytes (default 256).\n"
+                    " -K <opt> : On errors, rewind the simulation from the checkpoints:\n"
+                    "            'back=<num>' traces the last <num> cycles before the error,\n"
+                    "            'write=<addr>' shows the last write to the address.\n"
+                    " -H <num> : Number of last executed instructions to print on errors,\n"
+                    "            from 0 (disabled) to 65536. Default is 32.\n"
                     " -l <file>: Loads label file, used in simulation trace. With multiple\n"
-                    "            label files loaded, last one takes precedence.\n"
+                    "            label files loaded, last one takes precedence. With a ld65\n"
+                    "            debug file (.dbg) the profile includes the source lines.\n"
                     " -r <addr>: Loads rom at give address instead of XEX file\n"
-                    " -p <file>: Store profile information into file\n"
-                    " -P <file>: Read/write binary profile data to file, use to consolidate\n"
-                    "            more than one profile run\n"
+                    " -p <file>: Store profile information into file, including the\n"
+                    "            call graph and the memory reads and writes\n"
+                    " -P <file>: Add binary profile data to file, use to consolidate\n"
+                    "            more than one profile run, also from concurrent runs\n"
+                    "            The exit status is 1 if the file can't be updated.\n"
+                    " -c <file>: Store profile in callgrind format, to use with KCachegrind\n"
+                    " -F <file>: Store profile as collapsed stacks, to draw flame graphs\n"
+                    " -s <num>[,stack]: Sample the executed address each <num> cycles\n"
+                    "            on average, with 'stack' also the calling context.\n"
+                    " -S <file>: Store the sampling profile into file, the default\n"
+                    "            is one sample each 10000 cycles.\n"
+                    " -C <file>: Store code coverage in lcov format, using the source\n"
+                    "            lines from a debug file given with '-l'.\n"
+                    " -B <file>: Check cycle budgets, from a file with lines of a routine\n"
+                    "            label or address and the maximum cycles of each call.\n"
+                    "            The exit status is 2 if any call exceeds the budget.\n"
+                    " -A <file>: Store memory access heat map as a PPM image, with writes\n"
+                    "            in red, reads in green and executed code in blue\n"
+                    " -W <file>: Store the dead stores, overwritten before being read, and\n"
+                    "            the redundant loads of values already in the register.\n"
                     "\n"
                     "Advanced Options, given with '-o':\n"
                     " ntsc      : Emulate NTSC machine times (60Hz) (default)\n"
@@ -56,7 +98,14 @@ static void print_help(void)
                     " realtime  : Base time on real elapsed times (default)\n"
                     " cycletime : Base time on number of CPU cycles\n"
                     " fastmath  : Use Altirra fast math pack (default)\n"
-                    " atarimath : Use original Atari math pack\n",
+                    " atarimath : Use original Atari math pack\n"
+                    "\n"
+                    "Trace window, given with '-w' as a comma separated list:\n"
+                    " start=<addr> : Start tracing when PC reaches address or label\n"
+                    " cycle=<num>  : Start tracing after the given cycles\n"
+                    " count=<num>  : Stop tracing after the given instructions\n"
+                    " ret          : Stop tracing on return from current subroutine\n"
+                    " write=<addr> : Stop tracing on a write to address or label\n",
             prog_name);
 }
 
@@ -74,6 +123,606 @@ static void exit_error(const char *text)
     exit(1);
 }
 
+// Used to sort routines and edges by cycles
+static const uint64_t *sort_cycles;
+static int cmp_cycles(const void *a, const void *b)
+{
+    uint64_t ca = sort_cycles[*(const unsigned *)a];
+    uint64_t cb = sort_cycles[*(const unsigned *)b];
+    return (ca < cb) - (ca > cb);
+}
+
+static int cmp_edges(const void *a, const void *b)
+{
+    const struct sim65_call_edge *ea = a, *eb = b;
+    return (ea->cycles < eb->cycles) - (ea->cycles > eb->cycles);
+}
+
+// Writes the path of a calling context node, from the root
+static void print_context(FILE *f, sim65 s, const struct sim65_call_profile *cg,
+                          uint32_t node, const char *sep)
+{
+    char buf[32];
+    if (!node)
+    {
+        fputs("[root]", f);
+        return;
+    }
+    if (cg->nodes[node].parent)
+    {
+        print_context(f, s, cg, cg->nodes[node].parent, sep);
+        fputs(sep, f);
+    }
+    fputs(sim65_prof_name(s, cg->nodes[node].func, buf), f);
+}
+
+// Writes the zero page locations in a bitmap, as a list of ranges
+static void print_zp_ranges(FILE *f, const uint32_t *zp)
+{
+    for (unsigned i = 0; i < 0x100; i++)
+    {
+        if (!(zp[i >> 5] & (1U << (i & 31))))
+            continue;
+        unsigned j = i;
+        while (j < 0xFF && (zp[(j + 1) >> 5] & (1U << ((j + 1) & 31))))
+            j++;
+        if (j > i)
+            fprintf(f, " $%02X-$%02X", i, j);
+        else
+            fprintf(f, " $%02X", i);
+        i = j;
+    }
+}
+
+// Writes the call graph part of the profile
+static void store_call_graph(FILE *f, sim65 s, int digits)
+{
+    struct sim65_call_profile cg;
+    if (!sim65_get_call_profile(s, &cg))
+        return;
+
+    unsigned *idx = malloc(cg.max * sizeof(unsigned));
+    struct sim65_call_edge *edges = malloc((cg.num_edges + 1) * sizeof(*edges));
+    if (!idx || !edges)
+        exit_error("memory error");
+
+    uint64_t total = 0;
+    unsigned num   = 0;
+    for (unsigned i = 0; i < cg.max; i++)
+    {
+        total += cg.excl_cycles[i];
+        if (cg.calls[i] || cg.excl_cycles[i])
+            idx[num++] = i;
+    }
+    if (!total)
+        total = 1;
+    sort_cycles = cg.incl_cycles;
+    qsort(idx, num, sizeof(unsigned), cmp_cycles);
+
+    char buf[32], buf2[32];
+    fprintf(f, "--------- Routines: inclusive cycles, exclusive cycles, calls\n");
+    for (unsigned j = 0; j < num; j++)
+    {
+        unsigned i = idx[j];
+        fprintf(f, "%*" PRIu64 " %5.1f%% %*" PRIu64 " %5.1f%% %10" PRIu64 " %s\n",
+                digits, cg.incl_cycles[i], 100.0 * cg.incl_cycles[i] / total,
+                digits, cg.excl_cycles[i], 100.0 * cg.excl_cycles[i] / total,
+                cg.calls[i], sim65_prof_name(s, i, buf));
+    }
+
+    // Distribution of the cycles of each call, in the order of the routines
+    fprintf(f, "--------- Call cycles: returned calls, min, mean, p50, p90, p99, max\n");
+    for (unsigned j = 0; j < num; j++)
+    {
+        unsigned i = idx[j];
+        if (!cg.ret_calls[i])
+            continue;
+        fprintf(f, "%10" PRIu64 " %*" PRIu64 " %*.1f %*" PRIu64 " %*" PRIu64 " %*" PRIu64
+                   " %*" PRIu64 " %s\n",
+                cg.ret_calls[i], digits, cg.min_call[i], digits + 2,
+                (double)cg.ret_cycles[i] / cg.ret_calls[i], digits,
+                sim65_call_percentile(s, i, 50), digits, sim65_call_percentile(s, i, 90),
+                digits, sim65_call_percentile(s, i, 99), digits, cg.max_call[i],
+                sim65_prof_name(s, i, buf));
+    }
+
+    memcpy(edges, cg.edges, cg.num_edges * sizeof(*edges));
+    qsort(edges, cg.num_edges, sizeof(*edges), cmp_edges);
+    fprintf(f, "--------- Calls: inclusive cycles, calls, caller -> callee\n");
+    for (unsigned j = 0; j < cg.num_edges; j++)
+    {
+        const struct sim65_call_edge *e = &edges[j];
+        fprintf(f, "%*" PRIu64 " %5.1f%% %10" PRIu64 " %s", digits, e->cycles,
+                100.0 * e->cycles / total, e->calls, sim65_prof_name(s, e->caller, buf));
+        if (e->site < SIM65_PROF_NATIVE)
+            fprintf(f, " ($%04X)", e->site);
+        fprintf(f, " -> %s\n", sim65_prof_name(s, e->callee, buf2));
+    }
+
+    // Stack depth
+    if (cg.min_stack < 0x100)
+    {
+        fprintf(f, "--------- Deepest stack: S=$%02X (%u bytes free), at ", cg.min_stack,
+                cg.min_stack + 1);
+        print_context(f, s, &cg, cg.min_stack_node, ";");
+        fputc('\n', f);
+    }
+    if (cg.stack_wraps)
+    {
+        fprintf(f, "--------- Stack wrapped below $0100: %" PRIu64 " times, first at ",
+                cg.stack_wraps);
+        print_context(f, s, &cg, cg.stack_wrap_node, ";");
+        fputc('\n', f);
+    }
+
+    // Zero page used by each routine, in the order of the routines report
+    int zp_title = 0;
+    for (unsigned j = 0; j < num; j++)
+    {
+        const uint32_t *zp = cg.zp_used[idx[j]];
+        if (!zp)
+            continue;
+        if (!zp_title)
+            fprintf(f, "--------- Zero page used by routine\n");
+        zp_title = 1;
+        fprintf(f, "%s:", sim65_prof_name(s, idx[j], buf));
+        print_zp_ranges(f, zp);
+        fputc('\n', f);
+    }
+    free(edges);
+    free(idx);
+}
+
+static int cmp_loops(const void *a, const void *b)
+{
+    const struct sim65_loop *la = *(const struct sim65_loop **)a;
+    const struct sim65_loop *lb = *(const struct sim65_loop **)b;
+    return (la->cycles < lb->cycles) - (la->cycles > lb->cycles);
+}
+
+// Writes the loops, with the routine containing each one: the nearest label
+// before the loop head.
+static void store_loops(FILE *f, sim65 s, const struct sim65_profile *pdata, int digits)
+{
+    const struct sim65_loop *list;
+    unsigned num = sim65_get_loops(s, &list);
+    if (!num)
+        return;
+    const struct sim65_loop **idx = malloc(num * sizeof(*idx));
+    if (!idx)
+        exit_error("memory error");
+    for (unsigned i = 0; i < num; i++)
+        idx[i] = &list[i];
+    qsort(idx, num, sizeof(*idx), cmp_loops);
+    uint64_t total = 0;
+    for (unsigned i = 0; i < pdata->max; i++)
+        total += pdata->cycle_count[i];
+
+    char buf[32];
+    fprintf(f, "--------- Loops: cycles, runs, iterations, cycles per iteration, max iterations\n");
+    for (unsigned j = 0; j < num; j++)
+    {
+        const struct sim65_loop *lp = idx[j];
+        if (!lp->runs)
+            continue;
+        unsigned r = lp->head;
+        while (r && !(sim65_get_label(s, r) && *sim65_get_label(s, r) &&
+                      *sim65_get_label(s, r) != '@'))
+            r--;
+        fprintf(f, "%*" PRIu64 " %5.1f%% %10" PRIu64 " %10" PRIu64 " %8.1f %8" PRIu64
+                   " $%04X-$%04X in %s, trips",
+                digits, lp->cycles, 100.0 * lp->cycles / (total ? total : 1), lp->runs,
+                lp->iterations, (double)lp->cycles / lp->iterations, lp->max_trips,
+                lp->head, lp->tail, sim65_prof_name(s, r, buf));
+        for (unsigned b = 0; b < SIM65_LOOP_TRIPS; b++)
+        {
+            if (!lp->trips[b])
+                continue;
+            if (!b)
+                fprintf(f, " 1:%" PRIu64, lp->trips[b]);
+            else if (b == SIM65_LOOP_TRIPS - 1)
+                fprintf(f, " %u+:%" PRIu64, 1U << b, lp->trips[b]);
+            else
+                fprintf(f, " %u-%u:%" PRIu64, 1U << b, (2U << b) - 1, lp->trips[b]);
+        }
+        fputc('\n', f);
+    }
+    free(idx);
+}
+
+// Cycles lost in page crossing of the taken branches in the routine from
+// start to end, if the routine is moved by the given number of bytes.
+static uint64_t branch_cross_cycles(sim65 s, const struct sim65_profile *pdata,
+                                    unsigned start, unsigned end, unsigned move)
+{
+    uint64_t cyc = 0;
+    for (unsigned a = start; a < end && a < pdata->max; a++)
+    {
+        if (!pdata->branch_taken[a] || !sim65_ins_is_branch(s, a))
+            continue;
+        unsigned t = (a + 2 + (int8_t)sim65_get_byte(s, (a + 1) & 0xFFFF)) & 0xFFFF;
+        if (t >= start && t < end)
+            t += move;
+        if (((a + 2 + move) ^ t) & 0xFF00)
+            cyc += pdata->branch_taken[a];
+    }
+    return cyc;
+}
+
+// Page crossing advisor: the extra cycles of taken branches grouped by
+// routine and of indexed reads grouped by data table, with the padding
+// that avoids them.
+static void store_align(FILE *f, sim65 s, const struct sim65_profile *pdata, int digits)
+{
+    uint8_t *entry  = calloc(0x10000, 1);
+    uint64_t *tbl   = calloc(0x10000, sizeof(uint64_t));
+    uint64_t *reads = calloc(0x10000, sizeof(uint64_t));
+    unsigned *idx   = malloc(0x10000 * sizeof(unsigned));
+    if (!entry || !tbl || !reads || !idx)
+        exit_error("memory error");
+
+    // Routines start at called addresses, or at labels without call graph
+    struct sim65_call_profile cg;
+    if (sim65_get_call_profile(s, &cg))
+    {
+        for (unsigned i = 0; i < cg.max && i < 0x10000; i++)
+            entry[i] = cg.calls[i] != 0;
+    }
+    else
+        for (unsigned i = 0; i < 0x10000; i++)
+        {
+            const char *lbl = sim65_get_label(s, i);
+            entry[i]        = lbl && *lbl && *lbl != '@';
+        }
+    entry[0] = 1;
+
+    char buf[32], dis[256];
+    uint64_t total = 0, saved = 0;
+    fprintf(f, "--------- Page crossing by routine: extra cycles, recoverable cycles, routine\n");
+    for (unsigned a = 0; a < pdata->max; a++)
+    {
+        if (!pdata->extra_cycles[a] || !sim65_ins_is_branch(s, a))
+            continue;
+        unsigned start = a, end = a + 1;
+        while (!entry[start])
+            start--;
+        while (end < 0x10000 && !entry[end])
+            end++;
+        // Search the smallest padding before the routine with the minimum cost
+        uint64_t cyc = branch_cross_cycles(s, pdata, start, end, 0), best = cyc;
+        unsigned pad = 0;
+        for (unsigned m = 1; m < 256 && best; m++)
+        {
+            uint64_t c = branch_cross_cycles(s, pdata, start, end, m);
+            if (c < best)
+            {
+                best = c;
+                pad  = m;
+            }
+        }
+        fprintf(f, "%*" PRIu64 " %*" PRIu64 " %s $%04X-$%04X", digits, cyc, digits, cyc - best,
+                sim65_prof_name(s, start, buf), start, end - 1);
+        if (pad)
+            fprintf(f, ": insert %u bytes before, to start at $%04X\n", pad, start + pad);
+        else
+            fprintf(f, ": branch targets outside the routine, move the code\n");
+        total += cyc;
+        saved += cyc - best;
+        // List the branches, all cross the page each time they are taken
+        for (; a < end && a < pdata->max; a++)
+            if (pdata->extra_cycles[a] && sim65_ins_is_branch(s, a))
+                fprintf(f, "%*s %04X %s (crosses page %s)\n", 2 * digits + 1, "", a,
+                        sim65_disassemble(s, dis, a),
+                        pdata->cycle_count[a] == pdata->branch_taken[a] * 3 + pdata->extra_cycles[a]
+                            ? "always, never falls through"
+                            : "always when taken");
+        a--;
+    }
+
+    // Indexed reads, grouped by the nearest label before the base address,
+    // and indirect reads grouped by the zero page pointer
+    uint64_t ptr[256] = {0}, ptr_reads[256] = {0};
+    unsigned num      = 0;
+    for (unsigned a = 0; a < pdata->max; a++)
+    {
+        if (!pdata->extra_cycles[a] || sim65_ins_is_branch(s, a))
+            continue;
+        unsigned op  = sim65_get_byte(s, a);
+        unsigned arg = sim65_get_byte(s, (a + 1) & 0xFFFF);
+        if (!strcmp(sim65_opcode_mode(op), "(ind),y"))
+        {
+            ptr[arg & 0xFF] += pdata->extra_cycles[a];
+            ptr_reads[arg & 0xFF] += pdata->exec_count[a];
+            continue;
+        }
+        unsigned base = arg | (sim65_get_byte(s, (a + 2) & 0xFFFF) << 8), t = base;
+        while (t && t + 255 > base && !(sim65_get_label(s, t) && *sim65_get_label(s, t)))
+            t--;
+        if (!sim65_get_label(s, t) || !*sim65_get_label(s, t))
+            t = base;
+        if (!reads[t])
+            idx[num++] = t;
+        tbl[t] += pdata->extra_cycles[a];
+        reads[t] += pdata->exec_count[a];
+    }
+    sort_cycles = tbl;
+    qsort(idx, num, sizeof(unsigned), cmp_cycles);
+    fprintf(f, "--------- Page crossing by table: extra cycles, recoverable cycles, reads, table\n");
+    for (unsigned j = 0; j < num; j++)
+    {
+        // The table extends up to the next label, or a page without labels
+        unsigned t = idx[j], end = t + 1;
+        while (end < 0x10000 && end < t + 256 &&
+               !(sim65_get_label(s, end) && *sim65_get_label(s, end)))
+            end++;
+        unsigned size = end - t, low = t & 0xFF;
+        uint64_t rec  = (size <= 256 && (low + size > 256 || low)) ? tbl[t] : 0;
+        const char *lbl = sim65_get_label(s, t);
+        if (lbl && *lbl)
+            snprintf(buf, sizeof(buf), "%s", lbl);
+        else
+            snprintf(buf, sizeof(buf), "$%04X", t);
+        fprintf(f, "%*" PRIu64 " %*" PRIu64 " %10" PRIu64 " %s $%04X-$%04X", digits, tbl[t],
+                digits, rec, reads[t], buf, t, end - 1);
+        if (size > 256)
+            fprintf(f, ": larger than a page, split the table\n");
+        else if (low + size > 256)
+        {
+            fprintf(f, ": insert %u bytes before, to start at $%04X", 256 - low, t + 256 - low);
+            if (size < 256)
+                fprintf(f, ", or place it at $xx00-$xx%02X", 256 - size);
+            fputc('\n', f);
+        }
+        else if (low)
+            fprintf(f, ": reads past the table end, align it to start at $%04X\n",
+                    t + 256 - low);
+        else
+            fprintf(f, ": reads past the table end\n");
+        total += tbl[t];
+        saved += rec;
+    }
+    fprintf(f, "--------- Page crossing by pointer: extra cycles, reads, pointer\n");
+    for (unsigned p = 0; p < 256; p++)
+        if (ptr[p])
+        {
+            fprintf(f, "%*" PRIu64 " %10" PRIu64 " ($%02X),Y: align the buffers pointed to a page\n",
+                    digits, ptr[p], ptr_reads[p], p);
+            total += ptr[p];
+        }
+    fprintf(f, "--------- Page crossing total: %" PRIu64 " extra cycles, %" PRIu64
+               " recoverable moving routines and tables\n",
+            total, saved);
+    free(entry);
+    free(tbl);
+    free(reads);
+    free(idx);
+}
+
+// Counts grouped by a name, for the opcode report
+struct name_count
+{
+    const char *name;
+    uint64_t count, cycles;
+};
+
+static int cmp_name_count(const void *a, const void *b)
+{
+    const struct name_count *na = a, *nb = b;
+    return (na->cycles < nb->cycles) - (na->cycles > nb->cycles);
+}
+
+// Adds count and cycles to the group with the given name
+static unsigned add_name_count(struct name_count *g, unsigned num, const char *name,
+                               uint64_t count, uint64_t cycles)
+{
+    unsigned i;
+    for (i = 0; i < num && strcmp(g[i].name, name); i++)
+        ;
+    if (i == num)
+    {
+        g[i].name   = name;
+        g[i].count  = 0;
+        g[i].cycles = 0;
+        num++;
+    }
+    g[i].count += count;
+    g[i].cycles += cycles;
+    return num;
+}
+
+static void print_name_count(FILE *f, const char *title, struct name_count *g,
+                             unsigned num, uint64_t total, int digits)
+{
+    qsort(g, num, sizeof(*g), cmp_name_count);
+    fprintf(f, "--------- %s: count, cycles\n", title);
+    for (unsigned i = 0; i < num; i++)
+        fprintf(f, "%*" PRIu64 " %*" PRIu64 " %5.1f%% %s\n", digits, g[i].count,
+                digits, g[i].cycles, 100.0 * g[i].cycles / total, g[i].name);
+}
+
+// Writes the executed opcodes, mnemonics, addressing modes and opcode pairs
+static void store_op_prof(FILE *f, const struct sim65_profile *pdata, int digits)
+{
+    struct name_count g[256];
+    char names[256][16];
+    uint64_t total = 0;
+    for (unsigned i = 0; i < 256; i++)
+        total += pdata->op_cycles[i];
+    if (!total)
+        return;
+
+    unsigned num = 0;
+    for (unsigned i = 0; i < 256; i++)
+        if (pdata->op_count[i])
+        {
+            snprintf(names[i], sizeof(names[i]), "%s %s", sim65_opcode_name(i),
+                     sim65_opcode_mode(i));
+            num = add_name_count(g, num, names[i], pdata->op_count[i], pdata->op_cycles[i]);
+        }
+    print_name_count(f, "Opcodes", g, num, total, digits);
+
+    num = 0;
+    for (unsigned i = 0; i < 256; i++)
+        if (pdata->op_count[i])
+            num = add_name_count(g, num, sim65_opcode_name(i), pdata->op_count[i],
+                                 pdata->op_cycles[i]);
+    print_name_count(f, "Mnemonics", g, num, total, digits);
+
+    num = 0;
+    for (unsigned i = 0; i < 256; i++)
+        if (pdata->op_count[i])
+            num = add_name_count(g, num, sim65_opcode_mode(i), pdata->op_count[i],
+                                 pdata->op_cycles[i]);
+    print_name_count(f, "Addressing modes", g, num, total, digits);
+
+    // Most frequent pairs, uses a partial selection sort
+    uint64_t pairs = 0;
+    for (unsigned i = 0; i < 0x10000; i++)
+        pairs += pdata->op_pairs[i];
+    fprintf(f, "--------- Opcode pairs: count\n");
+    unsigned top[32];
+    for (num = 0; num < 32; num++)
+    {
+        unsigned best = 0;
+        uint64_t bval = 0;
+        for (unsigned i = 0; i < 0x10000; i++)
+        {
+            uint64_t v = pdata->op_pairs[i];
+            if (v > bval)
+            {
+                unsigned j;
+                for (j = 0; j < num && top[j] != i; j++)
+                    ;
+                if (j == num)
+                {
+                    best = i;
+                    bval = v;
+                }
+            }
+        }
+        if (!bval)
+            break;
+        top[num] = best;
+        fprintf(f, "%*" PRIu64 " %5.1f%% %s %s -> %s %s\n", digits, bval, 100.0 * bval / pairs,
+                sim65_opcode_name(best >> 8), sim65_opcode_mode(best >> 8),
+                sim65_opcode_name(best & 0xFF), sim65_opcode_mode(best & 0xFF));
+    }
+}
+
+// Used to sort address ranges by accesses
+struct mem_range
+{
+    unsigned start, used;
+    uint64_t reads, writes;
+};
+
+static int cmp_ranges(const void *a, const void *b)
+{
+    const struct mem_range *ra = a, *rb = b;
+    uint64_t ta = ra->reads + ra->writes, tb = rb->reads + rb->writes;
+    return (ta < tb) - (ta > tb);
+}
+
+// Writes the memory access part of the profile
+static void store_mem_prof(FILE *f, sim65 s, const struct sim65_profile *pdata, int digits)
+{
+    const uint64_t *rd = pdata->mem_reads, *wr = pdata->mem_writes;
+    char buf[32];
+
+    // Zero page, each location
+    unsigned zp_used = 0;
+    uint64_t zp_rd = 0, zp_wr = 0;
+    for (unsigned i = 0; i < 0x100; i++)
+    {
+        zp_used += (rd[i] || wr[i]);
+        zp_rd += rd[i];
+        zp_wr += wr[i];
+    }
+    fprintf(f, "--------- Zero page: %u locations used, %" PRIu64 " reads, %" PRIu64 " writes\n",
+            zp_used, zp_rd, zp_wr);
+    for (unsigned i = 0; i < 0x100; i++)
+        if (rd[i] || wr[i])
+        {
+            const char *lbl = sim65_get_label(s, i);
+            fprintf(f, "%*" PRIu64 " %*" PRIu64 " $%02X%s%s\n", digits, rd[i], digits, wr[i],
+                    i, (lbl && *lbl) ? " " : "", lbl ? lbl : "");
+        }
+
+    // Stack, the lowest address used gives the maximum depth
+    unsigned st_low = 0x200;
+    uint64_t st_rd = 0, st_wr = 0;
+    for (unsigned i = 0x100; i < 0x200; i++)
+    {
+        if ((rd[i] || wr[i]) && i < st_low)
+            st_low = i;
+        st_rd += rd[i];
+        st_wr += wr[i];
+    }
+    if (st_low < 0x200)
+        fprintf(f, "--------- Stack: lowest address $%04X (%u bytes), %" PRIu64 " reads, %" PRIu64 " writes\n",
+                st_low, 0x1FF - st_low + 1, st_rd, st_wr);
+
+    // Rest of memory, grouped from each label to the next one
+    struct mem_range *ranges = malloc(0x10000 * sizeof(*ranges));
+    if (!ranges)
+        exit_error("memory error");
+    unsigned num = 0;
+    for (unsigned i = 0x200; i < 0x10000; i++)
+    {
+        const char *lbl = sim65_get_label(s, i);
+        if (!num || i == 0x200 || (lbl && *lbl))
+        {
+            ranges[num].start  = i;
+            ranges[num].used   = 0;
+            ranges[num].reads  = 0;
+            ranges[num].writes = 0;
+            num++;
+        }
+        ranges[num - 1].used += (rd[i] || wr[i]);
+        ranges[num - 1].reads += rd[i];
+        ranges[num - 1].writes += wr[i];
+    }
+    qsort(ranges, num, sizeof(*ranges), cmp_ranges);
+    fprintf(f, "--------- Memory: reads, writes, label (bytes used)\n");
+    for (unsigned i = 0; i < num && (ranges[i].reads || ranges[i].writes); i++)
+        fprintf(f, "%*" PRIu64 " %*" PRIu64 " %s (%u)\n", digits, ranges[i].reads,
+                digits, ranges[i].writes, sim65_prof_name(s, ranges[i].start, buf),
+                ranges[i].used);
+    free(ranges);
+}
+
+// Writes a 256x256 image of the memory with the accesses of each address:
+// writes in red, reads in green and executed cycles in blue.
+static void store_heat_map(const char *fname, sim65 s)
+{
+    FILE *f = fopen(fname, "wb");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open heat map file.");
+    }
+    struct sim65_profile pdata = sim65_get_profile_info(s);
+    const uint64_t *data[3]    = { pdata.mem_writes, pdata.mem_reads, pdata.cycle_count };
+    double scale[3];
+    for (int c = 0; c < 3; c++)
+    {
+        uint64_t max = 1;
+        for (unsigned i = 0; i < 0x10000; i++)
+            if (data[c][i] > max)
+                max = data[c][i];
+        scale[c] = 255.0 / log(1.0 + max);
+    }
+    fprintf(f, "P6\n256 256\n255\n");
+    for (unsigned i = 0; i < 0x10000; i++)
+        for (int c = 0; c < 3; c++)
+            fputc((int)(scale[c] * log(1.0 + data[c][i]) + 0.5), f);
+    if (fclose(f))
+    {
+        perror(fname);
+        exit_error("can't write heat map file.");
+    }
+}
+
 static void store_prof(const char *fname, sim65 s)
 {
     FILE *f = fopen(fname, "w");
@@ -82,59 +731,483 @@ static void store_prof(const char *fname, sim65 s)
         perror(fname);
         exit_error("can't open profile.");
     }
+    int digits                 = sim65_store_prof_summary(f, s, 1);
     struct sim65_profile pdata = sim65_get_profile_info(s);
-    uint64_t max_count         = 1000;
+
+    store_op_prof(f, &pdata, digits);
+    store_call_graph(f, s, digits);
+    store_loops(f, s, &pdata, digits);
+    if (pdata.total.branch_extra || pdata.total.extra_abs_x || pdata.total.extra_abs_y ||
+        pdata.total.extra_ind_y)
+        store_align(f, s, &pdata, digits);
+    store_mem_prof(f, s, &pdata, digits);
+    if (dbg_info)
+        dbginfo_store_profile(dbg_info, f, pdata.cycle_count);
+    fclose(f);
+}
+
+// Writes profile in callgrind format, for KCachegrind and callgrind_annotate
+static void store_callgrind(const char *fname, sim65 s, const char *prog)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open callgrind profile.");
+    }
+    struct sim65_profile pdata = sim65_get_profile_info(s);
+    struct sim65_call_profile cg;
+    int have_cg = sim65_get_call_profile(s, &cg);
+
+    if (!prog)
+        prog = "???";
+    fprintf(f, "# callgrind format\n"
+               "version: 1\n"
+               "creator: atarisim\n"
+               "cmd: %s\n"
+               "positions: instr\n"
+               "event: Cyc : Cycles\n"
+               "event: Tkn : Branches taken\n"
+               "event: Xpg : Page crossing extra cycles\n"
+               "event: Nop : Cycles without useful work\n"
+               "events: Cyc Tkn Xpg Nop\n"
+               "ob=%s\n"
+               "fl=%s\n",
+            prog, prog, prog);
+
+    // Instructions belong to the last called routine before them, or to the
+    // last label if no routine was called before.
+    char buf[32], buf2[32];
+    int func = -1, cur = -1;
     for (unsigned i = 0; i < pdata.max; i++)
-        if (pdata.cycle_count[i] > max_count)
-            max_count = pdata.cycle_count[i];
-    int digits = 0;
-    while (max_count)
     {
-        digits++;
-        max_count /= 10;
+        if (have_cg && cg.calls[i])
+            func = i;
+        else if (func < 0 || !(have_cg && cg.calls[func]))
+        {
+            const char *lbl = sim65_get_label(s, i);
+            if (lbl && *lbl)
+                func = i;
+        }
+        if (!pdata.cycle_count[i])
+            continue;
+        if (func != cur)
+        {
+            cur = func;
+            fprintf(f, "fn=%s\n", func < 0 ? "???" : sim65_prof_name(s, func, buf));
+        }
+        uint64_t nop = pdata.cycle_count[i] <= pdata.flag_change[i] ? pdata.cycle_count[i] : 0;
+        fprintf(f, "0x%04X %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", i,
+                pdata.cycle_count[i], pdata.branch_taken[i], pdata.extra_cycles[i], nop);
+    }
+
+    // Call edges, native frames have no address
+    for (unsigned i = 0; have_cg && i < cg.num_edges; i++)
+    {
+        const struct sim65_call_edge *e = &cg.edges[i];
+        fprintf(f, "fn=%s\ncfn=%s\ncalls=%" PRIu64 " 0x%04X\n0x%04X %" PRIu64 "\n",
+                sim65_prof_name(s, e->caller, buf), sim65_prof_name(s, e->callee, buf2),
+                e->calls, e->callee < SIM65_PROF_NATIVE ? e->callee : 0,
+                e->site < SIM65_PROF_NATIVE ? e->site : 0, e->cycles);
+    }
+    fclose(f);
+}
+
+// Writes the calling context tree as collapsed stacks, for flame graphs
+static void store_folded(const char *fname, sim65 s)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open collapsed stacks file.");
+    }
+    struct sim65_call_profile cg;
+    if (sim65_get_call_profile(s, &cg))
+    {
+        // The root node is not written
+        for (unsigned i = 1; i < cg.num_nodes; i++)
+            if (cg.nodes[i].cycles)
+            {
+                print_context(f, s, &cg, i, ";");
+                fprintf(f, " %" PRIu64 "\n", cg.nodes[i].cycles);
+            }
+    }
+    fclose(f);
+}
+
+// Writes the sampling profile: samples by routine, by address and by context
+static void store_samples(const char *fname, sim65 s)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open sampling profile.");
     }
+    struct sim65_sample_profile sp = sim65_get_sample_profile(s);
+    struct sim65_call_profile cg;
+    int have_cg = sim65_get_call_profile(s, &cg);
+    unsigned max = have_cg ? cg.max : 0x10000;
+    uint64_t *rs = calloc(max, sizeof(uint64_t));
+    unsigned *idx = malloc((have_cg && cg.num_nodes > max ? cg.num_nodes : max) * sizeof(unsigned));
+    if (!rs || !idx)
+        exit_error("memory error");
+    uint64_t total = sp.total ? sp.total : 1;
+    fprintf(f, "--------- Samples: %" PRIu64 ", one each %" PRIu64 " cycles\n", sp.total,
+            sp.period);
+
+    // Routines from the call graph, or from each label to the next one
+    if (have_cg)
+        for (unsigned i = 0; i < cg.num_nodes; i++)
+            rs[cg.nodes[i].func] += cg.nodes[i].samples;
+    else
+        for (unsigned i = 0, r = 0; i < 0x10000; i++)
+        {
+            const char *lbl = sim65_get_label(s, i);
+            if (lbl && *lbl && *lbl != '@')
+                r = i;
+            rs[r] += sp.samples[i];
+        }
+    unsigned num = 0;
+    for (unsigned i = 0; i < max; i++)
+        if (rs[i])
+            idx[num++] = i;
+    sort_cycles = rs;
+    qsort(idx, num, sizeof(unsigned), cmp_cycles);
     char buf[256];
+    fprintf(f, "--------- Routines: samples\n");
+    for (unsigned j = 0; j < num; j++)
+        fprintf(f, "%10" PRIu64 " %5.1f%% %s\n", rs[idx[j]], 100.0 * rs[idx[j]] / total,
+                sim65_prof_name(s, idx[j], buf));
+
+    num = 0;
+    for (unsigned i = 0; i < 0x10000; i++)
+        if (sp.samples[i])
+            idx[num++] = i;
+    sort_cycles = sp.samples;
+    qsort(idx, num, sizeof(unsigned), cmp_cycles);
+    fprintf(f, "--------- Addresses: samples\n");
+    for (unsigned j = 0; j < num; j++)
+        fprintf(f, "%10" PRIu64 " %5.1f%% %04X %s\n", sp.samples[idx[j]],
+                100.0 * sp.samples[idx[j]] / total, idx[j], sim65_disassemble(s, buf, idx[j]));
+
+    // Calling contexts, as collapsed stacks
+    if (have_cg)
+    {
+        fprintf(f, "--------- Contexts: samples\n");
+        for (unsigned i = 0; i < cg.num_nodes; i++)
+            if (cg.nodes[i].samples)
+            {
+                fprintf(f, "%10" PRIu64 " %5.1f%% ", cg.nodes[i].samples,
+                        100.0 * cg.nodes[i].samples / total);
+                print_context(f, s, &cg, i, ";");
+                fputc('\n', f);
+            }
+    }
+    free(rs);
+    free(idx);
+    fclose(f);
+}
+
+// Writes the addresses with wasted executions, sorted by the wasted cycles
+static uint64_t print_waste(FILE *f, sim65 s, const char *title, const uint64_t *count,
+                            const uint64_t *cycles, const struct sim65_profile *pdata,
+                            unsigned *idx)
+{
+    unsigned num   = 0;
+    uint64_t total = 0;
+    for (unsigned i = 0; i < 0x10000; i++)
+        if (count[i])
+        {
+            idx[num++] = i;
+            total += cycles[i];
+        }
+    sort_cycles = cycles;
+    qsort(idx, num, sizeof(unsigned), cmp_cycles);
+    char buf[256];
+    fprintf(f, "--------- %s: cycles, executions, of all executions\n", title);
+    for (unsigned j = 0; j < num; j++)
+    {
+        unsigned i = idx[j];
+        uint64_t n = i < pdata->max && pdata->exec_count[i] ? pdata->exec_count[i] : 1;
+        fprintf(f, "%10" PRIu64 " %10" PRIu64 " %5.1f%% %04X %s\n", cycles[i], count[i],
+                100.0 * count[i] / n, i, sim65_disassemble(s, buf, i));
+    }
+    return total;
+}
+
+// Writes the dead stores and redundant loads
+static void store_dataflow(const char *fname, sim65 s)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open data flow file.");
+    }
+    struct sim65_dataflow df;
+    struct sim65_profile pdata = sim65_get_profile_info(s);
+    unsigned *idx              = malloc(0x10000 * sizeof(unsigned));
+    if (!idx)
+        exit_error("memory error");
+    sim65_get_dataflow(s, &df);
+    uint64_t total = 0;
     for (unsigned i = 0; i < pdata.max; i++)
-        if (pdata.cycle_count[i])
+        total += pdata.cycle_count[i];
+    if (!total)
+        total = 1;
+    uint64_t ds = print_waste(f, s, "Dead stores", df.dead_stores, df.dead_cycles, &pdata, idx);
+    uint64_t rl = print_waste(f, s, "Redundant loads", df.redundant_loads, df.redundant_cycles,
+                              &pdata, idx);
+    fprintf(f, "--------- Total cycles in dead stores:     %10" PRIu64 " (%.2f%%)\n"
+               "--------- Total cycles in redundant loads: %10" PRIu64 " (%.2f%%)\n",
+            ds, 100.0 * ds / total, rl, 100.0 * rl / total);
+    free(idx);
+    fclose(f);
+}
+
+// Adds an address to the coverage work list, only once, so the list never
+// holds more than 64K entries
+static void cov_push(uint8_t *code, unsigned *todo, unsigned *num, unsigned addr)
+{
+    if (code[addr])
+        return;
+    code[addr]     = 1;
+    todo[(*num)++] = addr;
+}
+
+// Writes the code coverage in lcov format. Without debug information, the
+// source is the program itself, using the addresses as line numbers. The
+// code not executed is found following the jumps from the executed code.
+static void store_coverage(const char *fname, sim65 s, const char *prog)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open coverage file.");
+    }
+    const uint8_t *cov = sim65_get_coverage(s);
+    if (dbg_info)
+    {
+        dbginfo_store_lcov(dbg_info, f, cov);
+        fclose(f);
+        return;
+    }
+
+    // Addresses are 1 when queued and 2 when decoded as an instruction
+    uint8_t *code  = calloc(0x10000, 1);
+    unsigned *todo = malloc(0x10000 * sizeof(unsigned));
+    unsigned num   = 0;
+    if (!code || !todo)
+        exit_error("memory error");
+    for (unsigned i = 0; i < 0x10000; i++)
+        if (cov[i] & (sim65_cov_next | sim65_cov_jump))
+            cov_push(code, todo, &num, i);
+    while (num)
+    {
+        unsigned addr = todo[--num];
+        unsigned op   = sim65_get_byte(s, addr);
+        // Stop at data: invalid memory or undocumented instructions
+        if (op > 0xFF || islower(*sim65_opcode_name(op)))
+            continue;
+        code[addr]   = 2;
+        unsigned len = sim65_opcode_len(op);
+        unsigned arg = sim65_get_byte(s, (addr + 1) & 0xFFFF) |
+                       (sim65_get_byte(s, (addr + 2) & 0xFFFF) << 8);
+        if (op == 0x20 || op == 0x4C)
+            cov_push(code, todo, &num, arg & 0xFFFF);
+        else if ((op & 0x1F) == 0x10)
+            cov_push(code, todo, &num, (addr + 2 + (int8_t)arg) & 0xFFFF);
+        // Continue to next instruction, except after returns and jumps
+        if (op != 0x40 && op != 0x60 && op != 0x4C && op != 0x6C && op != 0x00)
+            cov_push(code, todo, &num, (addr + len) & 0xFFFF);
+    }
+
+    fprintf(f, "TN:\nSF:%s\n", prog ? prog : "");
+    unsigned fnf = 0, fnh = 0;
+    for (unsigned i = 0; i < 0x10000; i++)
+    {
+        const char *lbl = sim65_get_label(s, i);
+        if (code[i] != 2 || !lbl || !*lbl || *lbl == '@')
+            continue;
+        int hit = !!(cov[i] & (sim65_cov_next | sim65_cov_jump));
+        fprintf(f, "FN:%u,%s\nFNDA:%d,%s\n", i, lbl, hit, lbl);
+        fnf++;
+        fnh += hit;
+    }
+    fprintf(f, "FNF:%u\nFNH:%u\n", fnf, fnh);
+    unsigned brf = 0, brh = 0;
+    for (unsigned i = 0; i < 0x10000; i++)
+        if (code[i] == 2 && (sim65_get_byte(s, i) & 0x1F) == 0x10)
         {
-            fprintf(f, "%*" PRIu64 " %04X %s", digits, pdata.cycle_count[i], i,
-                    sim65_disassemble(s, buf, i));
-            if (pdata.branch_taken[i])
+            if (cov[i] & sim65_cov_branch)
             {
-                // Calculate number of cycles spent on taken branches:
-                uint64_t cyc = pdata.branch_taken[i] * 3 + pdata.extra_cycles[i];
-                if (pdata.cycle_count[i] == cyc)
-                    fprintf(f, " (always taken");
-                else
-                    fprintf(f, " (%" PRIu64 " times taken", pdata.branch_taken[i]);
-                fprintf(f, "%s", pdata.extra_cycles[i] ? ", crosses page)" : ")");
+                int nt = !!(cov[i] & sim65_cov_next), tk = !!(cov[i] & sim65_cov_jump);
+                fprintf(f, "BRDA:%u,%u,0,%d\nBRDA:%u,%u,1,%d\n", i, i, nt, i, i, tk);
+                brh += nt + tk;
             }
-            else if (sim65_ins_is_branch(s, i))
-                fprintf(f, " (never taken)");
-            else if (pdata.extra_cycles[i])
-                fprintf(f, " (%" PRIu64 " times crossed pages)", pdata.extra_cycles[i]);
-            if (pdata.cycle_count[i] <= pdata.flag_change[i])
-                fprintf(f, " (no useful work)");
-            fputc('\n', f);
+            else
+                fprintf(f, "BRDA:%u,%u,0,-\nBRDA:%u,%u,1,-\n", i, i, i, i);
+            brf += 2;
+        }
+    fprintf(f, "BRF:%u\nBRH:%u\n", brf, brh);
+    unsigned lf = 0, lh = 0;
+    for (unsigned i = 0; i < 0x10000; i++)
+        if (code[i] == 2)
+        {
+            int hit = !!(cov[i] & (sim65_cov_next | sim65_cov_jump));
+            fprintf(f, "DA:%u,%d\n", i, hit);
+            lf++;
+            lh += hit;
         }
-    // Summary at end
-    uint64_t ti = pdata.total.instructions;
-    uint64_t tb = pdata.total.branch_skip + pdata.total.branch_taken;
-    fprintf(f, "--------- Total Instructions:    %10" PRIu64 "\n"
-               "--------- Total Branches:        %10" PRIu64 " (%.1f%% of instructions)\n"
-               "--------- Total Branches Taken:  %10" PRIu64 " (%.1f%% of branches)\n"
-               "--------- Branches cross-page:   %10" PRIu64 " (%.1f%% of taken branches)\n"
-               "--------- Absolute X cross-page: %10" PRIu64 "\n"
-               "--------- Absolute Y cross-page: %10" PRIu64 "\n"
-               "--------- Indirect Y cross-page: %10" PRIu64 "\n",
-            ti, tb, 100.0 * tb / ti,
-            pdata.total.branch_taken, 100.0 * pdata.total.branch_taken / tb,
-            pdata.total.branch_extra, 100.0 * pdata.total.branch_extra / pdata.total.branch_taken,
-            pdata.total.extra_abs_x, pdata.total.extra_abs_y, pdata.total.extra_ind_y);
+    fprintf(f, "LF:%u\nLH:%u\nend_of_record\n", lf, lh);
+    free(code);
+    free(todo);
+    fclose(f);
+}
+
+// Reports the routines that exceeded the cycle budget
+// @returns 1 if any routine exceeded the budget.
+static int check_budget(sim65 s)
+{
+    struct sim65_call_profile cg;
+    if (!sim65_get_call_profile(s, &cg))
+        return 0;
+    int fail = 0;
+    char buf[32];
+    for (unsigned i = 0; i < cg.max; i++)
+    {
+        if (!cg.over_budget[i])
+            continue;
+        fprintf(stderr, "%s: routine '%s' over budget of %" PRIu64 " cycles in %" PRIu64
+                        " of %" PRIu64 " calls, worst %" PRIu64 " cycles at ",
+                prog_name, sim65_prof_name(s, i, buf), cg.budget[i], cg.over_budget[i],
+                cg.calls[i], cg.max_call[i]);
+        print_context(stderr, s, &cg, cg.max_call_node[i], ";");
+        fputc('\n', stderr);
+        fail = 1;
+    }
+    return fail;
+}
+
+// Parses an address, as a number or a label name
+static int parse_addr(const char *str, sim65 s)
+{
+    char *end;
+    long addr;
+    if (*str == '$')
+        addr = strtol(str + 1, &end, 16);
+    else
+        addr = strtol(str, &end, 0);
+    if (end != str && !*end && addr >= 0 && addr <= 0xFFFF)
+        return addr;
+    addr = sim65_lbl_find(s, str);
+    if (addr < 0)
+        print_error("invalid address or label");
+    return addr;
+}
 
+// Reads the cycle budget file, with lines of "<routine> <cycles>"
+static void load_budget(const char *fname, sim65 s)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open cycle budget file");
+    }
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f))
+    {
+        char *name = strtok(buf, " \t\r\n");
+        char *cyc  = strtok(0, " \t\r\n");
+        char *end  = 0;
+        if (!name || *name == '#')
+            continue;
+        uint64_t max = cyc ? strtoull(cyc, &end, 0) : 0;
+        if (!max || *end)
+            exit_error("invalid line in cycle budget file");
+        sim65_set_cycle_budget(s, parse_addr(name, s), max);
+    }
     fclose(f);
 }
 
+static void set_trace_window(const char *spec, sim65 s)
+{
+    struct sim65_trace_window w = { .start_addr = -1, .stop_write = -1 };
+    char *buf                   = strdup(spec);
+    for (char *opt = strtok(buf, ","); opt; opt = strtok(0, ","))
+    {
+        char *val = strchr(opt, '=');
+        if (val)
+            *val++ = 0;
+        if (!strcmp(opt, "ret") && !val)
+            w.stop_ret = 1;
+        else if (!val)
+            print_error("invalid trace window");
+        else if (!strcmp(opt, "start"))
+            w.start_addr = parse_addr(val, s);
+        else if (!strcmp(opt, "cycle"))
+            w.start_cycle = strtoull(val, 0, 0);
+        else if (!strcmp(opt, "count"))
+            w.count = strtoull(val, 0, 0);
+        else if (!strcmp(opt, "write"))
+            w.stop_write = parse_addr(val, s);
+        else
+            print_error("invalid trace window");
+    }
+    free(buf);
+    sim65_set_trace_window(s, &w);
+}
+
+static void add_mem_trace(const char *range, sim65 s)
+{
+    char *buf = strdup(range);
+    char *end = strchr(buf, '-');
+    if (end)
+        *end++ = 0;
+    int start = parse_addr(buf, s);
+    int last  = end ? parse_addr(end, s) : start;
+    if (last < start)
+        print_error("invalid memory trace range");
+    sim65_add_mem_trace(s, start, last - start + 1);
+    free(buf);
+}
+
+// Rewinds the simulation after an error, as given in the option
+static void do_rewind(const char *opt, sim65 s)
+{
+    uint64_t end = sim65_get_cycles(s);
+    if (!strncmp(opt, "back=", 5))
+    {
+        uint64_t back   = strtoull(opt + 5, 0, 0);
+        uint64_t target = back < end ? end - back : 0;
+        fprintf(stderr, "%s: rewinding to cycle %" PRIu64 ".\n", prog_name, target);
+        if (sim65_rewind(s, target))
+            return;
+        // Trace up to the instruction causing the error
+        sim65_set_debug(s, sim65_debug_trace);
+        sim65_replay(s, end + 1);
+    }
+    else if (!strncmp(opt, "write=", 6))
+    {
+        int addr  = parse_addr(opt + 6, s);
+        int64_t c = sim65_find_last_write(s, addr);
+        if (c < 0)
+        {
+            fprintf(stderr, "%s: no write to $%04X since first checkpoint.\n", prog_name, addr);
+            return;
+        }
+        fprintf(stderr, "%s: last write to $%04X at cycle %" PRId64 ":\n", prog_name, addr, c);
+        if (sim65_rewind(s, c))
+            return;
+        sim65_print_history(s, stderr);
+        sim65_print_reg(s, stderr);
+    }
+}
+
 static void set_trace_file(const char *fname, sim65 s)
 {
     trace_file = fopen(fname, "w");
@@ -167,17 +1240,26 @@ static void handle_sigint(int sig)
 int main(int argc, char **argv)
 {
     int opt;
-    prog_name            = argv[0];
-    unsigned rom         = 0;
-    const char *profname = 0, *profdata = 0, *load_img = 0;
-    const char *rootpath = 0;
-    emu_options opts     = { .get_char = 0, .put_char = 0, .flags = 0 };
-    sim65 s              = sim65_new();
+    prog_name               = argv[0];
+    unsigned rom            = 0;
+    const char *profname    = 0, *profdata = 0, *load_img = 0;
+    const char *cgname      = 0, *foldname = 0, *heatname = 0;
+    const char *sampname    = 0, *covname = 0, *budname = 0, *flowname = 0;
+    uint64_t samp_period    = 10000;
+    int samp_stack          = 0;
+    const char *rootpath    = 0, *trace_win = 0;
+    const char *jnl_rec     = 0, *jnl_play = 0;
+    const char *rewind_opt  = 0;
+    uint64_t ckpt_interval  = 0, ckpt_mem = 256;
+    const char **mem_ranges = calloc(argc, sizeof(char *));
+    int num_ranges          = 0;
+    emu_options opts        = { .get_char = 0, .put_char = 0, .flags = 0 };
+    sim65 s                 = sim65_new();
 
     if (!s)
         exit_error("internal error");
 
-    while ((opt = getopt(argc, argv, "t:dbhr:l:e:p:P:I:DR:o:")) != -1)
+    while ((opt = getopt(argc, argv, "t:T:w:m:M:j:J:k:K:H:dbhr:l:e:p:P:c:F:s:S:C:B:A:W:I:DR:o:")) != -1)
     {
         switch (opt)
         {
@@ -185,6 +1267,50 @@ int main(int argc, char **argv)
                 sim65_set_debug(s, sim65_debug_trace);
                 set_trace_file(optarg, s);
                 break;
+            case 'T': // binary trace
+                if (sim65_set_binary_trace(s, optarg))
+                    exit_error("can't open binary trace file");
+                break;
+            case 'w': // trace window
+                trace_win = optarg;
+                break;
+            case 'm': // memory access trace
+                if (sim65_set_mem_trace(s, optarg))
+                    exit_error("can't open memory access trace file");
+                break;
+            case 'M': // memory access trace range
+                mem_ranges[num_ranges++] = optarg;
+                break;
+            case 'j': // record journal
+                jnl_rec = optarg;
+                break;
+            case 'J': // replay journal
+                jnl_play = optarg;
+                break;
+            case 'k': // checkpoints
+            {
+                char *end;
+                ckpt_interval = strtoull(optarg, &end, 0);
+                if (*end == ',')
+                    ckpt_mem = strtoull(end + 1, &end, 0);
+                if (*end || !ckpt_interval || !ckpt_mem)
+                    print_error("invalid checkpoint options");
+                break;
+            }
+            case 'K': // rewind on error
+                if (strncmp(optarg, "back=", 5) && strncmp(optarg, "write=", 6))
+                    print_error("invalid rewind option");
+                rewind_opt = optarg;
+                break;
+            case 'H': // history length
+            {
+                char *end;
+                unsigned long len = strtoul(optarg, &end, 0);
+                if (!*optarg || *end || *optarg == '-' || len > SIM65_MAX_HISTORY)
+                    print_error("invalid history length");
+                sim65_set_history(s, len);
+                break;
+            }
             case 'd': // debug
                 sim65_set_debug(s, sim65_debug_messages);
                 break;
@@ -218,15 +1344,63 @@ int main(int argc, char **argv)
             case 'r': // rom address
                 rom = strtol(optarg, 0, 0);
                 break;
-            case 'l': // label file
-                sim65_lbl_load(s, optarg);
+            case 'l': // label file or ld65 debug info
+            {
+                dbginfo *d = dbginfo_load(optarg);
+                if (d)
+                {
+                    dbginfo_free(dbg_info);
+                    dbg_info = d;
+                    dbginfo_add_labels(d, s);
+                }
+                else if (errno == EINVAL)
+                {
+                    perror(optarg);
+                    exit_error("can't read debug information file");
+                }
+                else
+                    sim65_lbl_load(s, optarg);
                 break;
+            }
             case 'p': // profile
                 profname = optarg;
                 break;
             case 'P': // profile data
                 profdata = optarg;
                 break;
+            case 'c': // callgrind profile
+                cgname = optarg;
+                break;
+            case 'F': // collapsed stacks
+                foldname = optarg;
+                break;
+            case 's': // sampling
+            {
+                char *end;
+                samp_period = strtoull(optarg, &end, 0);
+                if (!samp_period)
+                    print_error("invalid sampling options");
+                if (!strcmp(end, ",stack"))
+                    samp_stack = 1;
+                else if (*end)
+                    print_error("invalid sampling options");
+                break;
+            }
+            case 'S': // sampling profile
+                sampname = optarg;
+                break;
+            case 'C': // coverage
+                covname = optarg;
+                break;
+            case 'B': // cycle budget
+                budname = optarg;
+                break;
+            case 'A': // memory heat map
+                heatname = optarg;
+                break;
+            case 'W': // dead stores and redundant loads
+                flowname = optarg;
+                break;
             case 'R': // root path
                 rootpath = optarg;
                 break;
@@ -246,6 +1420,13 @@ int main(int argc, char **argv)
     // Initialize Atari emu
     atari_init(s, &opts);
 
+    // Set trace window and ranges after loading all labels
+    if (trace_win)
+        set_trace_window(trace_win, s);
+    for (int i = 0; i < num_ranges; i++)
+        add_mem_trace(mem_ranges[i], s);
+    free(mem_ranges);
+
     if (rootpath)
     {
         if (opts.flags & atari_opt_no_dos)
@@ -261,19 +1442,52 @@ int main(int argc, char **argv)
             atari_dos_add_cmdline(s, argv[i]);
     }
 
+    // Open journals
+    if (jnl_play && journal_replay(s, jnl_play))
+    {
+        perror(jnl_play);
+        exit_error("can't open journal file for replay");
+    }
+    if (jnl_rec && journal_record(s, jnl_rec))
+    {
+        perror(jnl_rec);
+        exit_error("can't create journal file");
+    }
+
+    // Enable checkpoints, the journal is needed to re-execute
+    if (rewind_opt && !ckpt_interval)
+        ckpt_interval = 1000000;
+    if (ckpt_interval)
+    {
+        sim65_set_checkpoints(s, ckpt_interval, ckpt_mem << 20);
+        journal_keep(s);
+    }
+
     // Load disk image
     if (load_img)
         if (atari_load_image(s, load_img))
             exit_error("can't load disk image");
 
     // Set profile info
-    if (profname || profdata)
+    if (profname || profdata || cgname || foldname || heatname || flowname)
         sim65_set_profiling(s, 1);
-
-    if (profdata)
+    if (profname || heatname || flowname)
+        sim65_set_mem_profiling(s, 1);
+    if ((profname || cgname || foldname) && sim65_set_call_profiling(s, 1))
+        exit_error("can't allocate call graph profiler");
+    if (profname && sim65_set_loop_profiling(s, 1))
+        exit_error("can't allocate loop profiler");
+    if (sampname && sim65_set_sampling(s, samp_period, samp_stack))
+        exit_error("can't allocate sampling profiler");
+    if (covname && sim65_set_coverage(s, 1))
+        exit_error("can't allocate coverage");
+    if (flowname && sim65_set_dataflow(s, 1))
+        exit_error("can't allocate data flow analysis");
+    if (budname)
     {
-        if (sim65_load_profile_data(s, profdata))
-            return 1;
+        if (sim65_set_call_profiling(s, 1))
+            exit_error("can't allocate call graph profiler");
+        load_budget(budname, s);
     }
 
     // Adds a signal handler for CONTROL-C, so we exit from the
@@ -310,14 +1524,34 @@ int main(int argc, char **argv)
         // Prints error message
         sim65_eprintf(s, "%s at address $%04x.",
                       sim65_error_str(s, e), sim65_error_addr(s));
+    if (e && rewind_opt)
+        do_rewind(rewind_opt, s);
     sim65_dprintf(s, "Total cycles: %ld", sim65_get_cycles(s));
 
-    if (profdata)
-        sim65_save_profile_data(s, profdata);
+    // The other reports are still written if the profile data can't be updated
+    int fail = 0;
+    if (profdata && sim65_update_profile_data(s, profdata))
+        fail = 1;
     if (profname)
         store_prof(profname, s);
+    if (cgname)
+        store_callgrind(cgname, s, fname ? fname : load_img);
+    if (foldname)
+        store_folded(foldname, s);
+    if (heatname)
+        store_heat_map(heatname, s);
+    if (sampname)
+        store_samples(sampname, s);
+    if (covname)
+        store_coverage(covname, s, fname ? fname : load_img);
+    if (flowname)
+        store_dataflow(flowname, s);
+    if (budname && check_budget(s) && !fail)
+        fail = 2;
+    journal_close();
+    dbginfo_free(dbg_info);
     sim65_free(s);
     if (trace_file)
         fclose(trace_file);
-    return 0;
+    return fail;
 }
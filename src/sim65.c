@@ -16,6 +16,10 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 #include "sim65.h"
+#include "callgraph.h"
+#include "dflow.h"
+#include "loops.h"
+#include "tracefile.h"
 #include <errno.h>
 #include <inttypes.h>
 #include <likely.h>
@@ -24,6 +28,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define MAXRAM (0x20000)
 
@@ -32,6 +41,9 @@
 #define ms_rom      2
 #define ms_invalid  4
 #define ms_callback 8
+#define ms_watch    16
+#define ms_mtrace   32
+#define ms_mprof    64
 
 // Instruction lengths
 static const uint8_t ilen[256] = {
@@ -45,6 +57,87 @@ static const uint8_t ilen[256] = {
     2, 2, 1, 1, 2, 2, 2, 1, 1, 2, 1, 1, 3, 3, 3, 1, 2, 2, 1, 1, 1, 2, 2, 1, 1, 3, 1, 1, 1, 3, 3, 1
 };
 
+// Addressing modes
+enum addr_mode
+{
+    am_imp, // Implied
+    am_acc, // Accumulator
+    am_imm, // Immediate
+    am_rel, // Relative (branches)
+    am_zpg, // Zero page
+    am_zpx, // Zero page indexed by X
+    am_zpy, // Zero page indexed by Y
+    am_abs, // Absolute
+    am_abx, // Absolute indexed by X
+    am_aby, // Absolute indexed by Y
+    am_ind, // Indirect (JMP only)
+    am_idx, // Indexed indirect by X
+    am_idy  // Indirect indexed by Y
+};
+
+// Instruction addressing modes
+static const uint8_t imode[256] = {
+    am_imp, am_idx, am_imp, am_idy, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_acc, am_imm, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idx, am_zpx, am_zpx, am_zpx, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_abx, am_abx,
+    am_abs, am_idx, am_imp, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_acc, am_imm, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpx, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_abx, am_abx,
+    am_imp, am_idx, am_imp, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_acc, am_imm, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpx, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_abx, am_abx,
+    am_imp, am_idx, am_imp, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_acc, am_imm, am_ind, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpx, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_abx, am_abx,
+    am_imm, am_idx, am_imm, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_imp, am_imm, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpy, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_aby, am_aby,
+    am_imm, am_idx, am_imm, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_imp, am_imp, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpy, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_aby, am_aby,
+    am_imm, am_idx, am_imm, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_imp, am_imm, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpx, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_abx, am_abx,
+    am_imm, am_idx, am_imm, am_idx, am_zpg, am_zpg, am_zpg, am_zpg, am_imp, am_imm, am_imp, am_imm, am_abs, am_abs, am_abs, am_abs,
+    am_rel, am_idy, am_imp, am_idy, am_zpx, am_zpx, am_zpx, am_zpx, am_imp, am_aby, am_imp, am_aby, am_abx, am_abx, am_abx, am_abx
+};
+
+// Addressing mode names
+static const char *const mode_name[] = {
+    "imp", "acc", "imm", "rel", "zp", "zp,x", "zp,y", "abs", "abs,x", "abs,y", "ind", "(ind,x)", "(ind),y"
+};
+
+// Instruction names, undocumented ones in lowercase
+static const char *const iname[256] = {
+    "BRK", "ORA", "kil", "slo", "dop", "ORA", "ASL", "slo", "PHP", "ORA", "ASL", "aac", "top", "ORA", "ASL", "slo",
+    "BPL", "ORA", "kil", "slo", "dop", "ORA", "ASL", "slo", "CLC", "ORA", "nop", "slo", "top", "ORA", "ASL", "slo",
+    "JSR", "AND", "kil", "rla", "BIT", "AND", "ROL", "rla", "PLP", "AND", "ROL", "aac", "BIT", "AND", "ROL", "rla",
+    "BMI", "AND", "kil", "rla", "dop", "AND", "ROL", "rla", "SEC", "AND", "nop", "rla", "top", "AND", "ROL", "rla",
+    "RTI", "EOR", "kil", "sre", "dop", "EOR", "LSR", "sre", "PHA", "EOR", "LSR", "asr", "JMP", "EOR", "LSR", "sre",
+    "BVC", "EOR", "kil", "sre", "dop", "EOR", "LSR", "sre", "CLI", "EOR", "nop", "sre", "top", "EOR", "LSR", "sre",
+    "RTS", "ADC", "kil", "rra", "dop", "ADC", "ROR", "rra", "PLA", "ADC", "ROR", "arr", "JMP", "ADC", "ROR", "rra",
+    "BVS", "ADC", "kil", "rra", "dop", "ADC", "ROR", "rra", "SEI", "ADC", "nop", "rra", "top", "ADC", "ROR", "rra",
+    "dop", "STA", "dop", "aax", "STY", "STA", "STX", "aax", "DEY", "dop", "TXA", "xaa", "STY", "STA", "STX", "aax",
+    "BCC", "STA", "kil", "axa", "STY", "STA", "STX", "aax", "TYA", "STA", "TXS", "xas", "sya", "STA", "sxa", "axa",
+    "LDY", "LDA", "LDX", "lax", "LDY", "LDA", "LDX", "lax", "TAY", "LDA", "TAX", "atx", "LDY", "LDA", "LDX", "lax",
+    "BCS", "LDA", "kil", "lax", "LDY", "LDA", "LDX", "lax", "CLV", "LDA", "TSX", "lar", "LDY", "LDA", "LDX", "lax",
+    "CPY", "CMP", "dop", "dcp", "CPY", "CMP", "DEC", "dcp", "INY", "CMP", "DEX", "axs", "CPY", "CMP", "DEC", "dcp",
+    "BNE", "CMP", "kil", "dcp", "dop", "CMP", "DEC", "dcp", "CLD", "CMP", "nop", "dcp", "top", "CMP", "DEC", "dcp",
+    "CPX", "SBC", "dop", "isc", "CPX", "SBC", "INC", "isc", "INX", "SBC", "NOP", "sbc", "CPX", "SBC", "INC", "isc",
+    "BEQ", "SBC", "kil", "isc", "dop", "SBC", "INC", "isc", "SED", "SBC", "nop", "isc", "top", "SBC", "INC", "isc"
+};
+
+// Entry in the flight recorder of last executed instructions, the operands
+// and effective address are recomputed from memory when printing
+struct hist_entry
+{
+    uint16_t pc;
+    uint8_t a, x, y, p, s;
+    uint8_t ins;
+};
+
+// Checkpoint of the simulation state, used to rewind
+struct checkpoint
+{
+    uint64_t cycles;
+    struct sim65_reg r;
+    uint8_t p_valid;
+    uint8_t *mem; // Copy of mem and mems
+};
+
 struct sim65s
 {
     enum sim65_debug debug;
@@ -55,6 +148,42 @@ struct sim65s
     uint64_t cycles;
     volatile uint64_t cycle_limit;
     unsigned do_prof;
+    callgraph *cg; // Call graph profiler, active with do_prof
+    int cg_calls;  // Track the calls in the call graph, not only sample contexts
+    uint16_t call_addr[256]; // Routine called from native code, by stack position
+    unsigned wtrack; // Send all writes to the slow path, to profile or trace them
+    trace_writer *btrace;
+    struct trace_rec trec; // Binary trace record of current instruction
+    struct hist_entry *hist; // Flight recorder, last executed instructions
+    unsigned hist_mask;
+    unsigned hist_pos;
+    unsigned run_depth; // Nesting level of sim65_run calls
+    // Trace window
+    struct sim65_trace_window twin;
+    enum
+    {
+        tw_off = 0,
+        tw_wait,
+        tw_active,
+        tw_done
+    } twin_state;
+    uint64_t twin_count; // Instructions traced in the window
+    uint8_t twin_s;      // Stack pointer at window start
+    int twin_hit;        // Watched address written
+    int trace_on;        // Tracing (text or binary) is active
+    mtrace_file *mtrace; // Memory access trace
+    uint16_t ins_pc;     // Address of current instruction
+    uint64_t ins_cycles; // Cycles at start of current instruction
+    // Checkpoints
+    struct checkpoint *ckpt;
+    unsigned ckpt_num;
+    unsigned ckpt_max;
+    uint64_t ckpt_interval;
+    uint64_t ckpt_next;     // Cycles of next checkpoint
+    uint64_t event_next;    // Cycles of next checkpoint or sample
+    int rewinding;          // Re-executing from a checkpoint
+    int rewind_addr;        // Address to find last write, -1 if none
+    uint64_t rewind_write;  // Cycles of last write to rewind_addr
     struct sim65_reg r;
     uint8_t p_valid;
     uint8_t mem[MAXRAM];
@@ -65,9 +194,16 @@ struct sim65s
     struct
     {
         uint64_t cycles[MAXRAM]; // Total number of cycles executing this instruction
+        uint64_t count[MAXRAM];  // Number of times this instruction was executed
         uint64_t branch[MAXRAM]; // Times this branch was taken
         uint64_t extra[MAXRAM];  // Number of extra cycles for crossing pages
         uint64_t mflag[MAXRAM];  // Number of times this ins actually modifies flags
+        uint64_t reads[MAXRAM];  // Number of data reads from this address
+        uint64_t writes[MAXRAM]; // Number of data writes to this address
+        uint64_t op_count[256];  // Number of times each opcode was executed
+        uint64_t op_cycles[256]; // Cycles executing each opcode
+        uint64_t op_pairs[256 * 256]; // Times each opcode followed other one
+        unsigned last_op;        // Last opcode plus one, 0 at start
         uint64_t branch_skip;    // Number of branches skipped
         uint64_t branch_taken;   // Number of branches taken
         uint64_t branch_extra;   // Extra cycles per branch to other page
@@ -77,11 +213,23 @@ struct sim65s
         uint64_t instructions;   // Number of instructions
     } prof;
     unsigned wmem; // Used by the profiler to detect write to memory
+    // Sampling profiler
+    struct
+    {
+        uint64_t period; // Mean cycles between samples
+        uint64_t next;   // Cycles of next sample
+        uint64_t total;  // Number of samples
+        uint64_t *pc;    // Samples at each address
+        uint32_t rand;   // State of the jitter generator
+    } samp;
+    uint8_t *cov; // Coverage flags
+    loops *loops; // Loop profiler
+    dflow *dflow; // Dead store and redundant load detection
     char *labels;
 };
 
 // Check if we should exit given this error, or simply log it
-static int get_error_exit(sim65 s)
+static int error_exit_slow(sim65 s)
 {
     int e = 0;
     switch (s->error)
@@ -118,6 +266,12 @@ static int get_error_exit(sim65 s)
         return s->error;
 }
 
+// Called after each instruction, the check of the error is inlined
+static inline int get_error_exit(sim65 s)
+{
+    return unlikely(s->error != sim65_err_none) && error_exit_slow(s);
+}
+
 void set_error(sim65 s, int e, uint16_t addr);
 
 static char *get_label(sim65 s, uint16_t addr)
@@ -166,11 +320,25 @@ sim65 sim65_new()
     s->p_valid    = 0xFF;
     set_flags(s, 0xFF, 0x34);
     memset(s->mems, ms_undef | ms_invalid, MAXRAM * sizeof(s->mems[0]));
+    sim65_set_history(s, 32);
+    s->ckpt_next   = UINT64_MAX;
+    s->event_next  = UINT64_MAX;
+    s->samp.next   = UINT64_MAX;
+    s->rewind_addr = -1;
     return s;
 }
 
 void sim65_free(sim65 s)
 {
+    sim65_set_binary_trace(s, 0);
+    sim65_set_mem_trace(s, 0);
+    sim65_set_checkpoints(s, 0, 0);
+    sim65_set_call_profiling(s, 0);
+    sim65_set_loop_profiling(s, 0);
+    sim65_set_dataflow(s, 0);
+    free(s->samp.pc);
+    free(s->cov);
+    free(s->hist);
     free(s->labels);
     free(s);
 }
@@ -200,6 +368,16 @@ void sim65_add_zeroed_ram(sim65 s, unsigned addr, unsigned len)
     }
 }
 
+// Stores one access into the memory access trace
+static void mtrace_access(sim65 s, uint16_t addr, uint8_t val, uint8_t flags)
+{
+    if (s->mtrace)
+    {
+        struct mtrace_rec r = { s->cycles, s->ins_pc, addr, val, flags };
+        mtrace_put(s->mtrace, &r);
+    }
+}
+
 void sim65_add_data_ram(sim65 s, unsigned addr, const unsigned char *data, unsigned len)
 {
     unsigned end = addr + len;
@@ -209,6 +387,9 @@ void sim65_add_data_ram(sim65 s, unsigned addr, const unsigned char *data, unsig
         end = MAXRAM;
     for (; addr < end; addr++, data++)
     {
+        // Writes from native handlers while running go to the memory access trace
+        if ((s->mems[addr] & ms_mtrace) && s->run_depth)
+            mtrace_access(s, addr, *data, mtrace_flag_write);
         s->mems[addr] &= ~(ms_undef | ms_rom | ms_invalid);
         s->mem[addr] = *data;
     }
@@ -265,6 +446,9 @@ unsigned sim65_get_byte(sim65 s, unsigned addr)
         return 0x100;
     if (s->mems[addr] & ms_invalid)
         return 0x100;
+    // Reads from native handlers while running go to the memory access trace
+    if ((s->mems[addr] & ms_mtrace) && s->run_depth)
+        mtrace_access(s, addr, s->mem[addr], 0);
     return s->mem[addr];
 }
 
@@ -293,15 +477,17 @@ static inline uint8_t readPc(sim65 s)
     return likely(!(s->mems[addr] & (ms_undef | ms_invalid))) ? s->mem[addr] : readPc_slow(s, addr);
 }
 
-static uint8_t readByte_slow(sim65 s, uint16_t addr)
+// Reads unusual memory: callbacks, undefined and uninitialized locations
+static uint8_t readMem_slow(sim65 s, uint16_t addr)
 {
+    uint8_t val;
     // Unusual memory
     if ((s->mems[addr] & ms_callback) && s->cb_read[addr])
     {
         int e = s->cb_read[addr](s, &s->r, addr, sim65_cb_read);
         set_error(s, e, addr);
         s->wmem = 1;
-        return e;
+        val     = e;
     }
     else
     {
@@ -316,19 +502,66 @@ static uint8_t readByte_slow(sim65 s, uint16_t addr)
             set_error(s, sim65_err_read_uninit, addr);
             s->mems[addr] &= ~ms_invalid; // Initializes the memory
         }
-        return s->mem[addr];
+        val = s->mem[addr];
+    }
+    return val;
+}
+
+static uint8_t readByte_slow(sim65 s, uint16_t addr)
+{
+    uint8_t val = readMem_slow(s, addr);
+    if (s->mems[addr] & ms_mtrace)
+        mtrace_access(s, addr, val, 0);
+    if ((s->mems[addr] & ms_mprof) && s->do_prof)
+    {
+        s->prof.reads[addr]++;
+        if (addr < 0x100 && s->cg_calls)
+            cg_zp_access(s->cg, addr);
+        if (s->dflow && !(s->mems[addr] & ms_callback))
+            dflow_read(s->dflow, addr);
     }
+    return val;
 }
 
 static inline uint8_t readByte(sim65 s, uint16_t addr)
 {
-    // Slow read if memory is undefined, invalid or a callback location:
-    return likely(!(s->mems[addr] & (ms_undef | ms_invalid | ms_callback))) ? s->mem[addr] : readByte_slow(s, addr);
+    // Slow read if memory is undefined, invalid, a callback location, traced or profiled:
+    return likely(!(s->mems[addr] & (ms_undef | ms_invalid | ms_callback | ms_mtrace | ms_mprof))) ? s->mem[addr] : readByte_slow(s, addr);
+}
+
+static inline uint8_t readOperand(sim65 s, uint16_t addr)
+{
+    // Instruction operands are not included in the memory access trace or profile
+    return likely(!(s->mems[addr] & (ms_undef | ms_invalid | ms_callback))) ? s->mem[addr] : readMem_slow(s, addr);
 }
 
 static void writeByte_slow(sim65 s, uint16_t addr, uint8_t val)
 {
-    if (!s->mems[addr])
+    if (s->btrace && s->trace_on)
+    {
+        s->trec.flags |= trace_flag_write;
+        s->trec.waddr = addr;
+        s->trec.wval  = val;
+    }
+    if (s->mems[addr] & ms_watch)
+    {
+        if (s->twin_state == tw_active && addr == s->twin.stop_write)
+            s->twin_hit = 1;
+        if (addr == s->rewind_addr)
+            s->rewind_write = s->ins_cycles;
+    }
+    if (s->mems[addr] & ms_mtrace)
+        mtrace_access(s, addr, val, mtrace_flag_write);
+    if ((s->mems[addr] & ms_mprof) && s->do_prof)
+    {
+        s->prof.writes[addr]++;
+        if (addr < 0x100 && s->cg_calls)
+            cg_zp_access(s->cg, addr);
+        if (s->dflow && !(s->mems[addr] & (ms_callback | ms_rom | ms_undef)))
+            dflow_write(s->dflow, addr);
+    }
+    unsigned ms = s->mems[addr] & ~(ms_watch | ms_mtrace | ms_mprof);
+    if (!ms)
     {
         if (val != s->mem[addr])
         {
@@ -338,23 +571,23 @@ static void writeByte_slow(sim65 s, uint16_t addr, uint8_t val)
         return;
     }
     s->wmem = 1;
-    if (likely(!(s->mems[addr] & ~ms_invalid)))
+    if (likely(!(ms & ~ms_invalid)))
     {
-        s->mem[addr]  = val;
-        s->mems[addr] = 0;
+        s->mem[addr] = val;
+        s->mems[addr] &= ms_watch | ms_mtrace | ms_mprof;
     }
-    else if ((s->mems[addr] & ms_callback) && s->cb_write[addr])
+    else if ((ms & ms_callback) && s->cb_write[addr])
         set_error(s, s->cb_write[addr](s, &s->r, addr, val), addr);
-    else if (s->mems[addr] & ms_undef)
+    else if (ms & ms_undef)
         set_error(s, sim65_err_write_undef, addr);
-    else if (s->mems[addr] & ms_rom)
+    else if (ms & ms_rom)
         set_error(s, sim65_err_write_rom, addr);
 }
 
 static inline void writeByte(sim65 s, uint16_t addr, uint8_t val)
 {
     // Slow write if memory have any flag (rom, undefined, invalid or a callback location):
-    if (likely(!(s->mems[addr]) && !s->do_prof))
+    if (likely(!(s->mems[addr]) && !s->wtrack))
         s->mem[addr] = val;
     else
         writeByte_slow(s, addr, val);
@@ -832,7 +1065,71 @@ static void do_rti(sim65 s)
     s->cycles += 2;
 }
 
-static int next(sim65 s)
+// Stores current instruction to the binary trace
+static void btrace_ins(sim65 s)
+{
+    struct trace_rec *t = &s->trec;
+    if (t->flags & trace_flag_valid)
+        trace_writer_put(s->btrace, t);
+    uint16_t pc = s->r.pc;
+    uint8_t ins = s->mem[pc];
+    t->cycles   = s->cycles;
+    t->pc       = pc;
+    t->a        = s->r.a;
+    t->x        = s->r.x;
+    t->y        = s->r.y;
+    t->p        = s->r.p;
+    t->s        = s->r.s;
+    t->ins[0]   = ins;
+    t->ins[1]   = s->mem[(pc + 1) & 0xFFFF];
+    t->ins[2]   = s->mem[(pc + 2) & 0xFFFF];
+    t->flags    = trace_flag_valid | ilen[ins];
+}
+
+// Updates tracing state from debug level, binary trace and trace window
+static void update_trace(sim65 s)
+{
+    s->trace_on = (s->debug >= sim65_debug_trace || s->btrace) &&
+                  (s->twin_state == tw_off || s->twin_state == tw_active);
+    s->wtrack   = s->do_prof || (s->btrace && s->trace_on);
+}
+
+// Checks start and stop conditions of the trace window
+static void trace_window(sim65 s)
+{
+    if (s->twin_state == tw_wait)
+    {
+        if (s->cycles < s->twin.start_cycle)
+            return;
+        if (s->twin.start_addr >= 0 && s->r.pc != s->twin.start_addr)
+            return;
+        sim65_dprintf(s, "trace started at $%04X", s->r.pc);
+        s->twin_state = tw_active;
+        s->twin_count = 0;
+        s->twin_s     = s->r.s;
+        s->twin_hit   = 0;
+        update_trace(s);
+    }
+    else
+    {
+        // Returned from the subroutine if the stack is above the return address
+        uint8_t sd = s->r.s - s->twin_s;
+        if ((s->twin.count && s->twin_count >= s->twin.count) ||
+            (s->twin.stop_ret && sd >= 2 && sd < 0x80) || s->twin_hit)
+        {
+            sim65_dprintf(s, "trace stopped at $%04X", s->r.pc);
+            s->twin_state = tw_done;
+            update_trace(s);
+            return;
+        }
+    }
+    s->twin_count++;
+}
+
+// Executes one instruction. With hooks set records the address and cycles of
+// the instruction, with hooks set to 2 also handles the trace window and the
+// traces.
+static inline __attribute__((always_inline)) int next_ins(sim65 s, const int hooks)
 {
     unsigned ins, data, val;
 
@@ -844,8 +1141,18 @@ static int next(sim65 s)
             return -1;
     }
 
-    if (s->debug >= sim65_debug_trace)
-        sim65_print_reg(s, s->trace_file);
+    if (hooks > 1)
+    {
+        if (unlikely(s->twin_state == tw_wait || s->twin_state == tw_active))
+            trace_window(s);
+        if (s->trace_on)
+        {
+            if (s->debug >= sim65_debug_trace)
+                sim65_print_reg(s, s->trace_file);
+            if (s->btrace)
+                btrace_ins(s);
+        }
+    }
 
     if (s->cycle_limit && s->cycles >= s->cycle_limit)
     {
@@ -855,11 +1162,29 @@ static int next(sim65 s)
 
     // Read instruction and data - always prefetched in real 6502 CPU
     ins  = readPc(s);
-    data = readByte(s, s->r.pc + 1);
+    data = readOperand(s, s->r.pc + 1);
+    if (hooks)
+    {
+        s->ins_pc     = s->r.pc;
+        s->ins_cycles = s->cycles;
+    }
 
     // And if instruction is 3 bytes, read high byte of data
     if (ilen[ins] > 2)
-        data |= readByte(s, s->r.pc + 2) << 8;
+        data |= readOperand(s, s->r.pc + 2) << 8;
+
+    // Store into flight recorder
+    if (s->hist)
+    {
+        struct hist_entry *h = &s->hist[s->hist_pos++ & s->hist_mask];
+        h->pc                = s->r.pc;
+        h->a                 = s->r.a;
+        h->x                 = s->r.x;
+        h->y                 = s->r.y;
+        h->p                 = s->r.p;
+        h->s                 = s->r.s;
+        h->ins               = ins;
+    }
 
     // Update PC
     s->r.pc += ilen[ins];
@@ -1022,6 +1347,137 @@ static int next(sim65 s)
     return ins;
 }
 
+// Plain execution, without the hooks
+static int next(sim65 s)
+{
+    return next_ins(s, 0);
+}
+
+// Execution for checkpoints, samples and memory access trace
+static int next_events(sim65 s)
+{
+    return next_ins(s, 1);
+}
+
+static int next_hooks(sim65 s)
+{
+    return next_ins(s, 2);
+}
+
+// Checks if the instructions need the traces or the trace window hooks
+static int need_trace(const sim65 s)
+{
+    return s->trace_on || s->twin_state == tw_wait || s->twin_state == tw_active;
+}
+
+// Stores a checkpoint, only from the outer level as callbacks can't be rewound
+static void checkpoint_take(sim65 s)
+{
+    if (s->run_depth != 1)
+    {
+        // Retry after one interval, to keep the event check out of each instruction
+        s->ckpt_next = s->cycles + s->ckpt_interval;
+        return;
+    }
+    if (s->ckpt_num == s->ckpt_max)
+    {
+        // No space left, remove every other checkpoint and double the interval
+        unsigned n = 0;
+        for (unsigned i = 0; i < s->ckpt_num; i++)
+        {
+            if (i & 1)
+                continue;
+            struct checkpoint t = s->ckpt[n];
+            s->ckpt[n++]        = s->ckpt[i];
+            s->ckpt[i]          = t;
+        }
+        s->ckpt_num = n;
+        s->ckpt_interval *= 2;
+    }
+    struct checkpoint *c = &s->ckpt[s->ckpt_num++];
+    c->cycles            = s->cycles;
+    c->r                 = s->r;
+    c->p_valid           = s->p_valid;
+    memcpy(c->mem, s->mem, MAXRAM);
+    memcpy(c->mem + MAXRAM, s->mems, MAXRAM);
+    s->ckpt_next = s->cycles + s->ckpt_interval;
+}
+
+// Records coverage of the last executed instruction
+static inline void coverage_add(sim65 s, int ins)
+{
+    unsigned pc = s->ins_pc;
+    s->cov[pc] |= (s->r.pc == ((pc + ilen[ins]) & 0xFFFF) ? sim65_cov_next : sim65_cov_jump) |
+                  ((ins & 0x1F) == 0x10 ? sim65_cov_branch : 0);
+}
+
+// Adds one sample to the calling context found in the stack page, without
+// tracking the calls: each return address pushed by a JSR gives the called
+// routine. Data in the stack can also look like a return address.
+static void sample_stack(sim65 s)
+{
+    uint32_t funcs[128];
+    unsigned num = 0;
+    for (unsigned sp = s->r.s + 1; sp < 0xFF; sp++)
+    {
+        unsigned ret = s->mem[0x100 + sp] | (s->mem[0x101 + sp] << 8);
+        if (ret == 0xFFFE)
+        {
+            // Return to native code, from sim65_call
+            funcs[num++] = s->call_addr[sp];
+            sp++;
+        }
+        else if (s->mem[(ret - 2) & 0xFFFF] == 0x20)
+        {
+            funcs[num++] = s->mem[(ret - 1) & 0xFFFF] | (s->mem[ret] << 8);
+            sp++;
+        }
+    }
+    cg_sample_context(s->cg, funcs, num);
+}
+
+// Takes one sample and sets the cycles of the next one. The sample goes to
+// the last executed instruction, as the sample time was reached during it.
+static void sample_take(sim65 s)
+{
+    s->samp.pc[s->ins_pc]++;
+    s->samp.total++;
+    if (s->cg_calls)
+        cg_sample(s->cg);
+    else if (s->cg)
+        sample_stack(s);
+    // Next sample in period/2 to 3*period/2 cycles, using xorshift32
+    s->samp.rand ^= s->samp.rand << 13;
+    s->samp.rand ^= s->samp.rand >> 17;
+    s->samp.rand ^= s->samp.rand << 5;
+    s->samp.next = s->cycles + s->samp.period / 2 + s->samp.rand % s->samp.period;
+}
+
+static void update_events(sim65 s)
+{
+    s->event_next = s->ckpt_next < s->samp.next ? s->ckpt_next : s->samp.next;
+}
+
+// Handles checkpoints and samples, called when the cycles reach event_next
+static void run_events(sim65 s)
+{
+    if (s->cycles >= s->ckpt_next)
+        checkpoint_take(s);
+    if (s->cycles >= s->samp.next)
+        sample_take(s);
+    update_events(s);
+}
+
+static void checkpoint_restore(sim65 s, const struct checkpoint *c)
+{
+    s->cycles  = c->cycles;
+    s->r       = c->r;
+    s->p_valid = c->p_valid;
+    s->error   = sim65_err_none;
+    memcpy(s->mem, c->mem, MAXRAM);
+    memcpy(s->mems, c->mem + MAXRAM, MAXRAM);
+}
+
 enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr)
 {
     if (regs)
@@ -1029,11 +1485,23 @@ enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr)
 
     s->error = sim65_err_none;
     s->r.pc  = addr;
+    s->run_depth++;
+
+    // Checkpoints are only valid inside the current outer call
+    if (s->run_depth == 1 && s->ckpt_interval)
+    {
+        s->ckpt_num  = 0;
+        s->ckpt_next = s->cycles;
+        update_events(s);
+    }
 
     if (s->do_prof)
     {
         while (!get_error_exit(s))
         {
+            if (unlikely(s->cycles >= s->event_next))
+                run_events(s);
+
             // If profiling, store old info for each instruction
             uint64_t old_cycles = 0;
             struct sim65_reg old_regs;
@@ -1042,7 +1510,7 @@ enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr)
             s->wmem    = 0;
 
             // Execute instruction
-            int ins = next(s);
+            int ins = next_hooks(s);
             if (ins < 1)
                 break;
 
@@ -1050,10 +1518,77 @@ enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr)
             unsigned cyc = s->cycles - old_cycles;
             s->prof.instructions++;
             s->prof.cycles[old_regs.pc & 0xFFFF] += cyc;
+            s->prof.count[old_regs.pc & 0xFFFF]++;
+            s->prof.op_count[ins]++;
+            s->prof.op_cycles[ins] += cyc;
+            if (s->prof.last_op)
+                s->prof.op_pairs[((s->prof.last_op - 1) << 8) | ins]++;
+            s->prof.last_op = ins + 1;
+            if (s->cov)
+                coverage_add(s, ins);
+            if (s->loops)
+                loops_step(s->loops, old_regs.pc, s->r.pc, ins, s->cycles);
+            if (s->dflow)
+            {
+                if (s->cb_exec[old_regs.pc])
+                    dflow_native(s->dflow);
+                dflow_step(s->dflow, s->ins_pc, ins, &old_regs, &s->r, cyc);
+            }
             if (s->r.a == old_regs.a && s->r.x == old_regs.x && s->r.y == old_regs.y && s->r.p == old_regs.p && s->r.s == old_regs.s && s->r.pc == old_regs.pc + ilen[ins] && !s->wmem)
             {
                 s->prof.mflag[old_regs.pc] += cyc;
             }
+
+            // Track calls and returns in the shadow stack
+            if (s->cg_calls)
+            {
+                cg_add_cycles(s->cg, cyc);
+                if (ins == 0x20)
+                    cg_push(s->cg, old_regs.pc, s->r.pc, s->r.s, s->cycles);
+                else if (ins == 0x60 || ins == 0x40 || ins == 0x9A)
+                    cg_return(s->cg, s->r.s, s->cycles);
+                cg_check_stack(s->cg, old_regs.s, s->r.s);
+            }
+        }
+    }
+    else if (s->cg_calls || s->cov)
+    {
+        // Call graph or coverage, only track calls and jumps
+        while (!get_error_exit(s))
+        {
+            if (unlikely(s->cycles >= s->event_next))
+                run_events(s);
+            int ins = next_hooks(s);
+            if (ins < 1)
+                break;
+            if (s->cov)
+                coverage_add(s, ins);
+            if (!s->cg_calls)
+                continue;
+            if (ins == 0x20)
+                cg_push(s->cg, s->ins_pc, s->r.pc, s->r.s, s->cycles);
+            else if (ins == 0x60 || ins == 0x40 || ins == 0x9A)
+                cg_return(s->cg, s->r.s, s->cycles);
+        }
+    }
+    else if (need_trace(s))
+    {
+        // Traces
+        while (!get_error_exit(s))
+        {
+            if (unlikely(s->cycles >= s->event_next))
+                run_events(s);
+            next_hooks(s);
+        }
+    }
+    else if (s->mtrace || s->event_next != UINT64_MAX)
+    {
+        // Checkpoints, samples or memory access trace
+        while (!get_error_exit(s))
+        {
+            if (unlikely(s->cycles >= s->event_next))
+                run_events(s);
+            next_events(s);
         }
     }
     else
@@ -1063,6 +1598,16 @@ enum sim65_error sim65_run(sim65 s, struct sim65_reg *regs, unsigned addr)
     if (regs)
         memcpy(regs, &s->r, sizeof(*regs));
 
+    // Dump flight recorder on errors from the outer level
+    s->run_depth--;
+    if (!s->run_depth && s->error != sim65_err_call_ret)
+    {
+        if (s->debug < sim65_debug_trace || s->trace_file != stderr)
+            sim65_print_history(s, stderr);
+        if (s->debug >= sim65_debug_trace)
+            sim65_print_history(s, s->trace_file);
+    }
+
     return s->error;
 }
 
@@ -1089,6 +1634,9 @@ enum sim65_error sim65_call(sim65 s, struct sim65_reg *regs, unsigned addr)
 
     // Execute a JSR
     do_jsr(s, addr);
+    s->call_addr[(s->r.s + 1) & 0xFF] = addr;
+    if (s->cg_calls)
+        cg_call(s->cg, addr, s->r.s, s->cycles);
 
     // And continue the emulator
     enum sim65_error err = sim65_run(s, 0, addr);
@@ -1107,6 +1655,7 @@ enum sim65_error sim65_call(sim65 s, struct sim65_reg *regs, unsigned addr)
 void sim65_set_debug(sim65 s, enum sim65_debug level)
 {
     s->debug = level;
+    update_trace(s);
 }
 
 void sim65_set_trace_file(sim65 s, FILE *f)
@@ -1117,6 +1666,189 @@ void sim65_set_trace_file(sim65 s, FILE *f)
         s->trace_file = stderr;
 }
 
+int sim65_set_binary_trace(sim65 s, const char *fname)
+{
+    int e = 0;
+    if (s->btrace)
+    {
+        // Flush last instruction and close
+        if (s->trec.flags & trace_flag_valid)
+            trace_writer_put(s->btrace, &s->trec);
+        e         = trace_writer_close(s->btrace);
+        s->btrace = 0;
+        if (e)
+            sim65_eprintf(s, "error writing binary trace");
+    }
+    if (fname)
+    {
+        s->btrace = trace_writer_open(fname);
+        if (!s->btrace)
+        {
+            sim65_eprintf(s, "%s: can't create binary trace: %s", fname, strerror(errno));
+            e = 1;
+        }
+    }
+    s->trec.flags = 0;
+    update_trace(s);
+    return e;
+}
+
+int sim65_set_mem_trace(sim65 s, const char *fname)
+{
+    int e = 0;
+    if (s->mtrace)
+    {
+        e         = mtrace_close(s->mtrace);
+        s->mtrace = 0;
+        if (e)
+            sim65_eprintf(s, "error writing memory access trace");
+    }
+    if (fname)
+    {
+        s->mtrace = mtrace_create(fname);
+        if (!s->mtrace)
+        {
+            sim65_eprintf(s, "%s: can't create memory access trace: %s", fname, strerror(errno));
+            e = 1;
+        }
+    }
+    return e;
+}
+
+void sim65_add_mem_trace(sim65 s, unsigned addr, unsigned len)
+{
+    for (unsigned i = addr; i < addr + len && i < MAXRAM; i++)
+        s->mems[i] |= ms_mtrace;
+}
+
+void sim65_set_checkpoints(sim65 s, uint64_t interval, uint64_t max_mem)
+{
+    for (unsigned i = 0; i < s->ckpt_max; i++)
+        free(s->ckpt[i].mem);
+    free(s->ckpt);
+    s->ckpt          = 0;
+    s->ckpt_num      = 0;
+    s->ckpt_max      = 0;
+    s->ckpt_interval = 0;
+    s->ckpt_next     = UINT64_MAX;
+    update_events(s);
+    if (!interval)
+        return;
+    unsigned n = max_mem / (2 * MAXRAM + sizeof(struct checkpoint));
+    if (n < 2)
+        n = 2;
+    s->ckpt = (struct checkpoint *)calloc(n, sizeof(struct checkpoint));
+    if (!s->ckpt)
+        return;
+    for (s->ckpt_max = 0; s->ckpt_max < n; s->ckpt_max++)
+        if (!(s->ckpt[s->ckpt_max].mem = (uint8_t *)malloc(2 * MAXRAM)))
+            break;
+    if (s->ckpt_max < 2)
+    {
+        sim65_eprintf(s, "not enough memory for checkpoints");
+        sim65_set_checkpoints(s, 0, 0);
+        return;
+    }
+    s->ckpt_interval = interval;
+    if (s->run_depth)
+        s->ckpt_next = s->cycles;
+    update_events(s);
+}
+
+uint64_t sim65_get_checkpoint_start(const sim65 s)
+{
+    return s->ckpt_num ? s->ckpt[0].cycles : s->cycles;
+}
+
+int sim65_is_rewinding(const sim65 s)
+{
+    return s->rewinding;
+}
+
+enum sim65_error sim65_replay(sim65 s, uint64_t cycle)
+{
+    // Disable profiling and traces to files while re-executing
+    int old_prof         = s->do_prof;
+    uint64_t old_limit   = s->cycle_limit;
+    trace_writer *old_bt = s->btrace;
+    mtrace_file *old_mt  = s->mtrace;
+    s->do_prof     = 0;
+    s->cycle_limit = 0;
+    s->btrace      = 0;
+    s->mtrace      = 0;
+    s->twin_state  = tw_off;
+    s->rewinding   = 1;
+    s->run_depth++;
+    update_trace(s);
+
+    while (!get_error_exit(s) && s->cycles < cycle)
+        next_hooks(s);
+
+    s->run_depth--;
+    s->rewinding   = 0;
+    s->do_prof     = old_prof;
+    s->cycle_limit = old_limit;
+    s->btrace      = old_bt;
+    s->mtrace      = old_mt;
+    update_trace(s);
+    return s->error;
+}
+
+enum sim65_error sim65_rewind(sim65 s, uint64_t cycle)
+{
+    // Search last checkpoint before the cycle
+    int i = s->ckpt_num - 1;
+    while (i >= 0 && s->ckpt[i].cycles > cycle)
+        i--;
+    if (i < 0)
+    {
+        sim65_eprintf(s, "no checkpoint before cycle %" PRIu64, cycle);
+        return sim65_err_user;
+    }
+    checkpoint_restore(s, &s->ckpt[i]);
+    s->hist_pos = 0;
+    return sim65_replay(s, cycle);
+}
+
+int64_t sim65_find_last_write(sim65 s, uint16_t addr)
+{
+    uint64_t end = s->cycles;
+    int64_t ret  = -1;
+    // Re-execute from each checkpoint, from the last to the first
+    for (int i = s->ckpt_num - 1; i >= 0 && ret < 0; i--)
+    {
+        uint64_t seg_end = (i + 1 < (int)s->ckpt_num) ? s->ckpt[i + 1].cycles : end;
+        checkpoint_restore(s, &s->ckpt[i]);
+        s->mems[addr] |= ms_watch;
+        s->rewind_addr  = addr;
+        s->rewind_write = UINT64_MAX;
+        sim65_replay(s, seg_end);
+        if (s->rewind_write != UINT64_MAX)
+            ret = s->rewind_write;
+    }
+    s->rewind_addr = -1;
+    if (s->twin_state == tw_off || s->twin.stop_write != addr)
+        s->mems[addr] &= ~ms_watch;
+    return ret;
+}
+
+void sim65_set_trace_window(sim65 s, const struct sim65_trace_window *w)
+{
+    // Remove old watched address
+    if (s->twin_state != tw_off && s->twin.stop_write >= 0)
+        s->mems[s->twin.stop_write & 0xFFFF] &= ~ms_watch;
+    if (w)
+    {
+        s->twin       = *w;
+        s->twin_state = tw_wait;
+        if (w->stop_write >= 0)
+            s->mems[w->stop_write & 0xFFFF] |= ms_watch;
+    }
+    else
+        s->twin_state = tw_off;
+    update_trace(s);
+}
+
 void sim65_set_error_level(sim65 s, enum sim65_error_lvl level)
 {
     s->errlvl = level;
@@ -1241,6 +1973,12 @@ static char *print_zp_label(sim65 s, char *buf, uint16_t addr, char idx)
     return buf;
 }
 
+// Reads a word for the trace hints, without side effects
+static uint16_t peekWord(const sim65 s, uint16_t addr)
+{
+    return s->mem[addr] | (s->mem[(uint16_t)(addr + 1)] << 8);
+}
+
 static char *print_ind_label(sim65 s, char *buf, uint16_t addr, char idx, int hint)
 {
     char *l = get_label(s, addr);
@@ -1274,11 +2012,11 @@ static char *print_ind_label(sim65 s, char *buf, uint16_t addr, char idx, int hi
         *buf++ = '$';
 
         if (idx == 'X')
-            buf = hex4(buf, readWord(s, 0xFF & (addr + s->r.x)));
+            buf = hex4(buf, peekWord(s, 0xFF & (addr + s->r.x)));
         else if (idx == 'Y')
-            buf = hex4(buf, readWord(s, addr) + s->r.y);
+            buf = hex4(buf, peekWord(s, addr) + s->r.y);
         else
-            buf = hex4(buf, readWord(s, addr));
+            buf = hex4(buf, peekWord(s, addr));
         *buf++ = ']';
     }
 
@@ -1344,7 +2082,7 @@ static char *print_ind_label(sim65 s, char *buf, uint16_t addr, char idx, int hi
     PLIDX(data)
 #define INSPRT_IDY(name)                    \
     PNAM(name);                             \
-    PXTRA(readWord(s, data), s->r.y, hint); \
+    PXTRA(peekWord(s, data), s->r.y, hint); \
     PLIDY(data)
 #define INSPRT_IDYW(name) \
     PNAM(name);           \
@@ -1675,6 +2413,60 @@ void sim65_print_reg(const sim65 s, FILE *f)
     putc('\n', f);
 }
 
+void sim65_set_history(sim65 s, unsigned len)
+{
+    free(s->hist);
+    s->hist      = 0;
+    s->hist_pos  = 0;
+    s->hist_mask = 0;
+    if (!len)
+        return;
+    if (len > SIM65_MAX_HISTORY)
+        len = SIM65_MAX_HISTORY;
+    // Round to a power of two
+    while (s->hist_mask < len - 1)
+        s->hist_mask = (s->hist_mask << 1) | 1;
+    s->hist = (struct hist_entry *)calloc(s->hist_mask + 1, sizeof(struct hist_entry));
+    if (!s->hist)
+        s->hist_mask = 0;
+}
+
+void sim65_print_history(const sim65 s, FILE *f)
+{
+    unsigned n = s->hist_mask + 1;
+    if (!s->hist || !s->hist_pos)
+        return;
+    if (n > s->hist_pos)
+        n = s->hist_pos;
+    fprintf(f, "sim65: last %u instructions executed:\n", n);
+    for (unsigned i = s->hist_pos - n; i != s->hist_pos; i++)
+    {
+        const struct hist_entry *h = &s->hist[i & s->hist_mask];
+        char buf[256];
+        // Operands and pointers are read from the current memory contents
+        unsigned data = peekWord(s, h->pc + 1);
+        int ea        = -1;
+        switch (imode[h->ins])
+        {
+            case am_zpg: ea = data & 0xFF; break;
+            case am_zpx: ea = (data + h->x) & 0xFF; break;
+            case am_zpy: ea = (data + h->y) & 0xFF; break;
+            case am_abs: ea = data; break;
+            case am_ind: ea = data; break;
+            case am_abx: ea = (data + h->x) & 0xFFFF; break;
+            case am_aby: ea = (data + h->y) & 0xFFFF; break;
+            case am_idx: ea = peekWord(s, (data + h->x) & 0xFF); break;
+            case am_idy: ea = (peekWord(s, data & 0xFF) + h->y) & 0xFFFF; break;
+        }
+        fprintf(f, "A=%02X X=%02X Y=%02X P=%02X S=%02X PC=%04X %s",
+                h->a, h->x, h->y, h->p, h->s, h->pc,
+                sim65_disassemble(s, buf, h->pc));
+        if (ea >= 0)
+            fprintf(f, "  EA=$%04X", ea);
+        putc('\n', f);
+    }
+}
+
 char *sim65_disassemble(const sim65 s, char *buf, uint16_t addr)
 {
     print_curr_ins(s, addr, buf, 0);
@@ -1822,9 +2614,15 @@ struct sim65_profile sim65_get_profile_info(const sim65 s)
 {
     struct sim65_profile r = { .max = MAXRAM };
     r.cycle_count          = s->prof.cycles;
+    r.exec_count           = s->prof.count;
     r.branch_taken         = s->prof.branch;
     r.extra_cycles         = s->prof.extra;
     r.flag_change          = s->prof.mflag;
+    r.mem_reads            = s->prof.reads;
+    r.mem_writes           = s->prof.writes;
+    r.op_count             = s->prof.op_count;
+    r.op_cycles            = s->prof.op_cycles;
+    r.op_pairs             = s->prof.op_pairs;
     r.total.branch_skip    = s->prof.branch_skip;
     r.total.branch_taken   = s->prof.branch_taken;
     r.total.branch_extra   = s->prof.branch_extra;
@@ -1836,43 +2634,243 @@ struct sim65_profile sim65_get_profile_info(const sim65 s)
     return r;
 }
 
+/* Profile data file, version 3:
+ *  "SIM65:PROF:3\n"
+ *  varint number of totals, followed by the totals.
+ *  varint number of arrays per address.
+ *  varint number of ranges, and for each range:
+ *   varint gap from the end of last range, varint length,
+ *   for each address, for each array the varint zig-zag encoded difference
+ *   to the value at the last address.
+ *  All values are in a single buffer, so the file can be memory-mapped.
+ */
+#define PROF_ARRAYS 5
+#define PROF_TOTALS 7
+#define PROF_GAP    4 // Zero values joined to a range instead of starting a new one
+
+static uint64_t *prof_array(sim65 s, int n)
+{
+    switch (n)
+    {
+        case 0: return s->prof.cycles;
+        case 1: return s->prof.count;
+        case 2: return s->prof.branch;
+        case 3: return s->prof.extra;
+        default: return s->prof.mflag;
+    }
+}
+
+static uint64_t *prof_total(sim65 s, int n)
+{
+    uint64_t *t[PROF_TOTALS] = { &s->prof.branch_skip, &s->prof.branch_taken,
+                                 &s->prof.branch_extra, &s->prof.abs_x_extra,
+                                 &s->prof.abs_y_extra, &s->prof.ind_y_extra,
+                                 &s->prof.instructions };
+    return t[n];
+}
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        putc(v | 0x80, f);
+        v >>= 7;
+    }
+    putc(v, f);
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+    for (int sh = 0; sh < 64 && *p < end; sh += 7)
+    {
+        uint8_t c = *(*p)++;
+        *v |= (uint64_t)(c & 0x7F) << sh;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return 1;
+}
+
+static int prof_used(sim65 s, unsigned addr)
+{
+    for (int n = 0; n < PROF_ARRAYS; n++)
+        if (prof_array(s, n)[addr])
+            return 1;
+    return 0;
+}
+
+// Returns the end of the range starting at addr
+static unsigned prof_range_end(sim65 s, unsigned addr)
+{
+    unsigned end = addr + 1, zeros = 0;
+    for (unsigned i = end; i < MAXRAM && zeros <= PROF_GAP; i++)
+    {
+        if (prof_used(s, i))
+        {
+            end   = i + 1;
+            zeros = 0;
+        }
+        else
+            zeros++;
+    }
+    return end;
+}
+
+static int save_profile(const sim65 s, FILE *f)
+{
+    int e = fprintf(f, "SIM65:PROF:3\n") < 0;
+    put_varint(f, PROF_TOTALS);
+    for (int n = 0; n < PROF_TOTALS; n++)
+        put_varint(f, *prof_total(s, n));
+    put_varint(f, PROF_ARRAYS);
+
+    unsigned nrange = 0;
+    for (unsigned i = 0; i < MAXRAM; i++)
+        if (prof_used(s, i))
+        {
+            i = prof_range_end(s, i);
+            nrange++;
+        }
+    put_varint(f, nrange);
+
+    uint64_t last[PROF_ARRAYS] = { 0 };
+    for (unsigned i = 0, pos = 0; i < MAXRAM; i++)
+        if (prof_used(s, i))
+        {
+            unsigned end = prof_range_end(s, i);
+            put_varint(f, i - pos);
+            put_varint(f, end - i);
+            for (; i < end; i++)
+                for (int n = 0; n < PROF_ARRAYS; n++)
+                {
+                    int64_t d = prof_array(s, n)[i] - last[n];
+                    put_varint(f, (d << 1) ^ (d >> 63));
+                    last[n] = prof_array(s, n)[i];
+                }
+            pos = end;
+        }
+    return e | ferror(f);
+}
+
 int sim65_save_profile_data(const sim65 s, const char *fname)
 {
-    FILE *f      = fopen(fname, "wb");
-    int e        = 0;
-    uint16_t ver = 0x100;
+    FILE *f = fopen(fname, "wb");
+    int e   = 0;
     if (!f)
     {
-        sim65_eprintf(s, "can't save profile data", strerror(errno));
+        sim65_eprintf(s, "can't save profile data: %s", strerror(errno));
         return 1;
     }
-    e = fprintf(f, "SIM65:PROF:2\n") < 0;
-    e |= fwrite(&ver, sizeof(ver), 1, f) < 1;
-    e |= fwrite(&s->prof.cycles[0], sizeof(s->prof.cycles[0]), MAXRAM, f) < MAXRAM;
-    e |= fwrite(&s->prof.branch[0], sizeof(s->prof.branch[0]), MAXRAM, f) < MAXRAM;
-    e |= fwrite(&s->prof.extra[0], sizeof(s->prof.extra[0]), MAXRAM, f) < MAXRAM;
-    e |= fwrite(&s->prof.mflag[0], sizeof(s->prof.mflag[0]), MAXRAM, f) < MAXRAM;
-    e |= fwrite(&s->prof.branch_skip, sizeof(s->prof.branch_skip), 1, f) < 1;
-    e |= fwrite(&s->prof.branch_taken, sizeof(s->prof.branch_taken), 1, f) < 1;
-    e |= fwrite(&s->prof.branch_extra, sizeof(s->prof.branch_extra), 1, f) < 1;
-    e |= fwrite(&s->prof.abs_x_extra, sizeof(s->prof.abs_x_extra), 1, f) < 1;
-    e |= fwrite(&s->prof.abs_y_extra, sizeof(s->prof.abs_y_extra), 1, f) < 1;
-    e |= fwrite(&s->prof.ind_y_extra, sizeof(s->prof.ind_y_extra), 1, f) < 1;
-    e |= fwrite(&s->prof.instructions, sizeof(s->prof.instructions), 1, f) < 1;
+    e = save_profile(s, f);
     e |= fclose(f) != 0;
     if (e)
     {
-        sim65_eprintf(s, "can't save profile data", strerror(errno));
+        sim65_eprintf(s, "can't save profile data: %s", strerror(errno));
         return 1;
     }
     return 0;
 }
 
-int sim65_load_profile_data(sim65 s, const char *fname)
+// Reads a version 3 profile data file, from the memory mapped file
+static int load_profile_v3(sim65 s, FILE *f)
+{
+    struct stat st;
+    if (fstat(fileno(f), &st) || st.st_size < 13)
+        return 1;
+    size_t size = st.st_size;
+    void *map   = mmap(0, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    const uint8_t *p = (const uint8_t *)map + 13, *end = (const uint8_t *)map + size;
+    uint64_t ntot, narr, nrange, v;
+    int e = get_varint(&p, end, &ntot);
+    for (uint64_t n = 0; !e && n < ntot; n++)
+    {
+        e = get_varint(&p, end, &v);
+        if (n < PROF_TOTALS)
+            *prof_total(s, n) += v;
+    }
+    e = e || get_varint(&p, end, &narr) || narr > 64 || get_varint(&p, end, &nrange);
+
+    uint64_t last[64] = { 0 }, pos = 0;
+    for (uint64_t r = 0; !e && r < nrange; r++)
+    {
+        uint64_t gap, len;
+        e = get_varint(&p, end, &gap) || get_varint(&p, end, &len) ||
+            pos + gap + len > MAXRAM;
+        for (uint64_t i = pos + gap; !e && i < pos + gap + len; i++)
+            for (unsigned n = 0; !e && n < narr; n++)
+            {
+                e = get_varint(&p, end, &v);
+                last[n] += (v >> 1) ^ -(v & 1);
+                if (n < PROF_ARRAYS)
+                    prof_array(s, n)[i] += last[n];
+            }
+        pos += gap + len;
+    }
+    e = e || p != end;
+    munmap(map, size);
+    return e;
+}
+
+// Reads an array of counters from a version 2 file, adding to dst
+static int read_add(FILE *f, uint64_t *dst, unsigned num)
+{
+    uint64_t buf[1024];
+    while (num)
+    {
+        unsigned n = num < 1024 ? num : 1024;
+        if (fread(buf, sizeof(buf[0]), n, f) < n)
+            return 1;
+        for (unsigned i = 0; i < n; i++)
+            dst[i] += buf[i];
+        dst += n;
+        num -= n;
+    }
+    return 0;
+}
+
+static int load_profile(sim65 s, FILE *f)
 {
     int e        = 0;
     uint16_t ver = 0;
-    FILE *f      = fopen(fname, "rb");
+    char buf[32] = "";
+    if (fgets(buf, 16, f) && !strcmp(buf, "SIM65:PROF:3\n"))
+    {
+        e = load_profile_v3(s, f);
+        if (e)
+            sim65_eprintf(s, "invalid profile data file");
+        return e;
+    }
+    if (strcmp(buf, "SIM65:PROF:2\n"))
+    {
+        sim65_eprintf(s, "not a profile data file");
+        return 1;
+    }
+    if (fread(&ver, sizeof(ver), 1, f) < 1 || (ver != 0x100 && ver != 0x101))
+    {
+        sim65_eprintf(s, "invalid profile data file version %04x", ver);
+        return 1;
+    }
+    e |= read_add(f, s->prof.cycles, MAXRAM);
+    e |= read_add(f, s->prof.branch, MAXRAM);
+    e |= read_add(f, s->prof.extra, MAXRAM);
+    e |= read_add(f, s->prof.mflag, MAXRAM);
+    // Version 0x100 does not have the execution counts
+    if (ver >= 0x101)
+        e |= read_add(f, s->prof.count, MAXRAM);
+    for (int n = 0; n < PROF_TOTALS; n++)
+        e |= read_add(f, prof_total(s, n), 1);
+    if (e)
+        sim65_eprintf(s, "can't read profile data: %s", strerror(errno));
+    return e;
+}
+
+int sim65_load_profile_data(sim65 s, const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
     if (!f)
     {
         if (errno == ENOENT)
@@ -1880,42 +2878,281 @@ int sim65_load_profile_data(sim65 s, const char *fname)
             sim65_dprintf(s, "missing profile data");
             return 0;
         }
-        sim65_eprintf(s, "can't load profile data", strerror(errno));
+        sim65_eprintf(s, "can't load profile data: %s", strerror(errno));
         return 1;
     }
-    char buf[32];
-    if (!fgets(buf, 16, f) || strcmp(buf, "SIM65:PROF:2\n"))
+    int e = load_profile(s, f);
+    fclose(f);
+    return e;
+}
+
+int sim65_update_profile_data(sim65 s, const char *fname)
+{
+    // The lock serializes all the processes updating the same file
+    int fd = open(fname, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || flock(fd, LOCK_EX))
     {
-        fclose(f);
-        sim65_eprintf(s, "not a profile data file");
+        sim65_eprintf(s, "can't update profile data: %s", strerror(errno));
+        if (fd >= 0)
+            close(fd);
         return 1;
     }
-    if (fread(&ver, sizeof(ver), 1, f) < 1 || ver != 0x100)
+    FILE *f = fdopen(fd, "r+b");
+    if (!f)
     {
-        fclose(f);
-        sim65_eprintf(s, "invalid profile data file version %04x", ver);
+        close(fd);
+        sim65_eprintf(s, "can't update profile data: %s", strerror(errno));
         return 1;
     }
-    e |= fread(&s->prof.cycles[0], sizeof(s->prof.cycles[0]), MAXRAM, f) < MAXRAM;
-    e |= fread(&s->prof.branch[0], sizeof(s->prof.branch[0]), MAXRAM, f) < MAXRAM;
-    e |= fread(&s->prof.extra[0], sizeof(s->prof.extra[0]), MAXRAM, f) < MAXRAM;
-    e |= fread(&s->prof.mflag[0], sizeof(s->prof.mflag[0]), MAXRAM, f) < MAXRAM;
-    e |= fread(&s->prof.branch_skip, sizeof(s->prof.branch_skip), 1, f) < 1;
-    e |= fread(&s->prof.branch_taken, sizeof(s->prof.branch_taken), 1, f) < 1;
-    e |= fread(&s->prof.branch_extra, sizeof(s->prof.branch_extra), 1, f) < 1;
-    e |= fread(&s->prof.abs_x_extra, sizeof(s->prof.abs_x_extra), 1, f) < 1;
-    e |= fread(&s->prof.abs_y_extra, sizeof(s->prof.abs_y_extra), 1, f) < 1;
-    e |= fread(&s->prof.ind_y_extra, sizeof(s->prof.ind_y_extra), 1, f) < 1;
-    e |= fread(&s->prof.instructions, sizeof(s->prof.instructions), 1, f) < 1;
-    if (e)
-        sim65_eprintf(s, "can't read profile data", strerror(errno));
+    struct stat st;
+    int e = fstat(fd, &st);
+    if (!e && st.st_size)
+        e = load_profile(s, f);
+    if (!e)
+    {
+        rewind(f);
+        e = ftruncate(fd, 0) || save_profile(s, f) || fflush(f);
+        if (e)
+            sim65_eprintf(s, "can't update profile data: %s", strerror(errno));
+    }
     fclose(f);
     return e;
 }
 
+void sim65_add_profile_data(sim65 s, const sim65 src)
+{
+    for (int n = 0; n < PROF_ARRAYS; n++)
+    {
+        uint64_t *restrict d       = prof_array(s, n);
+        const uint64_t *restrict o = prof_array(src, n);
+        for (unsigned i = 0; i < MAXRAM; i++)
+            d[i] += o[i];
+    }
+    for (int n = 0; n < PROF_TOTALS; n++)
+        *prof_total(s, n) += *prof_total(src, n);
+}
+
+int sim65_store_prof_summary(FILE *f, const sim65 s, int disasm)
+{
+    struct sim65_profile pdata = sim65_get_profile_info(s);
+    uint64_t max_count         = 1000;
+    for (unsigned i = 0; i < pdata.max; i++)
+        if (pdata.cycle_count[i] > max_count)
+            max_count = pdata.cycle_count[i];
+    int digits = 0;
+    while (max_count)
+    {
+        digits++;
+        max_count /= 10;
+    }
+    char buf[256];
+    for (unsigned i = 0; i < pdata.max; i++)
+        if (pdata.cycle_count[i])
+        {
+            if (disasm)
+                fprintf(f, "%*" PRIu64 " %04X %s", digits, pdata.cycle_count[i], i,
+                        sim65_disassemble(s, buf, i));
+            else
+            {
+                const char *lbl = sim65_get_label(s, i);
+                fprintf(f, "%*" PRIu64 " %*" PRIu64 " %04X %s", digits, pdata.cycle_count[i],
+                        digits, pdata.exec_count[i], i, lbl ? lbl : "");
+            }
+            if (pdata.branch_taken[i])
+            {
+                // Calculate number of cycles spent on taken branches:
+                uint64_t cyc = pdata.branch_taken[i] * 3 + pdata.extra_cycles[i];
+                if (pdata.cycle_count[i] == cyc)
+                    fprintf(f, " (always taken");
+                else
+                    fprintf(f, " (%" PRIu64 " times taken", pdata.branch_taken[i]);
+                fprintf(f, "%s", pdata.extra_cycles[i] ? ", crosses page)" : ")");
+            }
+            else if (disasm && sim65_ins_is_branch(s, i))
+                fprintf(f, " (never taken)");
+            else if (pdata.extra_cycles[i])
+                fprintf(f, " (%" PRIu64 " times crossed pages)", pdata.extra_cycles[i]);
+            if (pdata.cycle_count[i] <= pdata.flag_change[i])
+                fprintf(f, " (no useful work)");
+            fputc('\n', f);
+        }
+    // Summary at end
+    uint64_t ti = pdata.total.instructions;
+    uint64_t tb = pdata.total.branch_skip + pdata.total.branch_taken;
+    fprintf(f, "--------- Total Instructions:    %10" PRIu64 "\n"
+               "--------- Total Branches:        %10" PRIu64 " (%.1f%% of instructions)\n"
+               "--------- Total Branches Taken:  %10" PRIu64 " (%.1f%% of branches)\n"
+               "--------- Branches cross-page:   %10" PRIu64 " (%.1f%% of taken branches)\n"
+               "--------- Absolute X cross-page: %10" PRIu64 "\n"
+               "--------- Absolute Y cross-page: %10" PRIu64 "\n"
+               "--------- Indirect Y cross-page: %10" PRIu64 "\n",
+            ti, tb, 100.0 * tb / ti,
+            pdata.total.branch_taken, 100.0 * pdata.total.branch_taken / tb,
+            pdata.total.branch_extra, 100.0 * pdata.total.branch_extra / pdata.total.branch_taken,
+            pdata.total.extra_abs_x, pdata.total.extra_abs_y, pdata.total.extra_ind_y);
+    return digits;
+}
+
 void sim65_set_profiling(const sim65 s, int set)
 {
     s->do_prof = set;
+    update_trace(s);
+}
+
+void sim65_set_mem_profiling(sim65 s, int set)
+{
+    for (unsigned i = 0; i < MAXRAM; i++)
+        if (set)
+            s->mems[i] |= ms_mprof;
+        else
+            s->mems[i] &= ~ms_mprof;
+}
+
+int sim65_set_call_profiling(sim65 s, int set)
+{
+    if (!set)
+    {
+        cg_free(s->cg);
+        s->cg = 0;
+    }
+    else if (!s->cg)
+    {
+        s->cg = cg_new();
+        if (!s->cg)
+            return 1;
+    }
+    s->cg_calls = set;
+    return 0;
+}
+
+int sim65_set_sampling(sim65 s, uint64_t period, int stacks)
+{
+    free(s->samp.pc);
+    s->samp.pc     = 0;
+    s->samp.period = period;
+    s->samp.next   = UINT64_MAX;
+    s->samp.total  = 0;
+    s->samp.rand   = 0x2545F491;
+    if (period)
+    {
+        s->samp.pc = calloc(MAXRAM, sizeof(uint64_t));
+        // The calling contexts are read from the stack page at each sample
+        if (!s->samp.pc || (stacks && !s->cg && !(s->cg = cg_new())))
+        {
+            sim65_set_sampling(s, 0, 0);
+            return 1;
+        }
+        s->samp.next = s->cycles + period / 2 + s->samp.rand % period;
+    }
+    update_events(s);
+    return 0;
+}
+
+int sim65_set_loop_profiling(sim65 s, int set)
+{
+    loops_free(s->loops);
+    s->loops = set ? loops_new(s->prof.count) : 0;
+    return set && !s->loops;
+}
+
+unsigned sim65_get_loops(const sim65 s, const struct sim65_loop **list)
+{
+    return s->loops ? loops_get(s->loops, list) : 0;
+}
+
+int sim65_set_dataflow(sim65 s, int set)
+{
+    dflow_free(s->dflow);
+    s->dflow = set ? dflow_new() : 0;
+    return set && !s->dflow;
+}
+
+int sim65_get_dataflow(const sim65 s, struct sim65_dataflow *d)
+{
+    if (!s->dflow)
+        return 0;
+    *d = dflow_get(s->dflow);
+    return 1;
+}
+
+int sim65_set_coverage(sim65 s, int set)
+{
+    free(s->cov);
+    s->cov = set ? calloc(MAXRAM, 1) : 0;
+    return set && !s->cov;
+}
+
+const uint8_t *sim65_get_coverage(const sim65 s)
+{
+    return s->cov;
+}
+
+struct sim65_sample_profile sim65_get_sample_profile(const sim65 s)
+{
+    struct sim65_sample_profile p = { s->samp.period, s->samp.total, s->samp.pc };
+    return p;
+}
+
+int sim65_get_call_profile(const sim65 s, struct sim65_call_profile *p)
+{
+    if (!s->cg)
+        return 0;
+    cg_get_profile(s->cg, p);
+    return 1;
+}
+
+int sim65_set_cycle_budget(sim65 s, uint16_t addr, uint64_t cycles)
+{
+    if (!s->cg)
+        return 1;
+    cg_set_budget(s->cg, addr, cycles);
+    return 0;
+}
+
+uint64_t sim65_call_percentile(const sim65 s, uint32_t id, double pct)
+{
+    return s->cg ? cg_call_percentile(s->cg, id, pct) : 0;
+}
+
+void sim65_prof_enter(sim65 s, const char *format, ...)
+{
+    if (!s->cg_calls)
+        return;
+    char buf[64];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    cg_enter(s->cg, cg_native(s->cg, buf), s->r.s, s->cycles);
+}
+
+const char *sim65_prof_name(const sim65 s, uint32_t id, char buf[32])
+{
+    if (id >= SIM65_PROF_NATIVE)
+    {
+        const char *name = s->cg ? cg_native_name(s->cg, id) : 0;
+        return name ? name : "[unknown]";
+    }
+    const char *lbl = get_label(s, id);
+    if (lbl && *lbl)
+        return lbl;
+    snprintf(buf, 32, "$%04X", id);
+    return buf;
+}
+
+const char *sim65_opcode_name(uint8_t op)
+{
+    return iname[op];
+}
+
+const char *sim65_opcode_mode(uint8_t op)
+{
+    return mode_name[imode[op]];
+}
+
+unsigned sim65_opcode_len(uint8_t op)
+{
+    return ilen[op];
 }
 
 const char *sim65_get_label(const sim65 s, uint16_t addr)
@@ -1923,6 +3160,15 @@ const char *sim65_get_label(const sim65 s, uint16_t addr)
     return get_label(s, addr);
 }
 
+int sim65_lbl_find(const sim65 s, const char *name)
+{
+    if (s->labels && name && *name)
+        for (unsigned i = 0; i < 0x10000; i++)
+            if (!strcmp(get_label(s, i), name))
+                return i;
+    return -1;
+}
+
 // memswap from CCAN
 #define MEMSWAP_TMP_SIZE 256
 static void memswap(void *a, void *b, size_t n)
@@ -67,6 +67,8 @@ struct sim65_profile
     const unsigned max;
     /// Array with count of cycles executing instructions at each address, from 0 to max-1.
     const uint64_t *cycle_count;
+    /// Array with count of executions of the instruction at each address, from 0 to max-1.
+    const uint64_t *exec_count;
     /// Array with count of taken branches from each address, from 0 to max-1.
     const uint64_t *branch_taken;
     /// Array with count of extra cycles incurred because branch or indexed access
@@ -76,6 +78,16 @@ struct sim65_profile
     /// flags on execution, for each address, from 0 to max-1.
     /// This is used to detect unneeded flag setting instructions.
     const uint64_t *flag_change;
+    /// Arrays with count of data reads and writes to each address, from 0 to
+    /// max-1, only collected with memory profiling active.
+    const uint64_t *mem_reads;
+    const uint64_t *mem_writes;
+    /// Arrays with the count of executions and cycles of each opcode, from 0 to 255.
+    const uint64_t *op_count;
+    const uint64_t *op_cycles;
+    /// Array with the count of each pair of consecutive opcodes, at index
+    /// first * 256 + second.
+    const uint64_t *op_pairs;
     struct
     {
         /// Total number of cycles
@@ -97,6 +109,114 @@ struct sim65_profile
     } total;
 };
 
+/// First routine id of native handler frames in the call graph, lower
+/// ids are the routine addresses.
+#define SIM65_PROF_NATIVE 0x10000
+
+/// Call graph edge, from a call site to a routine.
+struct sim65_call_edge
+{
+    /// Routine id of the caller
+    uint32_t caller;
+    /// Address of the JSR instruction, or routine id for calls from native code
+    uint32_t site;
+    /// Routine id of the called routine
+    uint32_t callee;
+    /// Number of calls
+    uint64_t calls;
+    /// Cycles spent in the called routine, including routines called from it
+    uint64_t cycles;
+};
+
+/// Node in the calling context tree, all the call stacks seen.
+struct sim65_cct_node
+{
+    /// Index of the parent node, the root node (index 0) has itself as parent
+    uint32_t parent;
+    /// Routine id
+    uint32_t func;
+    /// Cycles executed in this context, excluding called routines
+    uint64_t cycles;
+    /// Samples taken in this context, excluding called routines
+    uint64_t samples;
+};
+
+/// Call graph profile information
+struct sim65_call_profile
+{
+    /// Number of elements in the routine arrays
+    unsigned max;
+    /// Times each routine was called
+    const uint64_t *calls;
+    /// Cycles in each routine, including called routines
+    const uint64_t *incl_cycles;
+    /// Cycles in each routine, excluding called routines
+    const uint64_t *excl_cycles;
+    /// Call edges
+    unsigned num_edges;
+    const struct sim65_call_edge *edges;
+    /// Calling context tree, parents are always before children
+    unsigned num_nodes;
+    const struct sim65_cct_node *nodes;
+    /// Minimum value of the stack pointer, and context node where it was reached
+    unsigned min_stack;
+    uint32_t min_stack_node;
+    /// Number of times the stack wrapped below $0100, and context node of the first
+    uint64_t stack_wraps;
+    uint32_t stack_wrap_node;
+    /// Zero page locations accessed by each routine, as bitmaps of 256 bits,
+    /// null for routines without accesses. Only with memory profiling active.
+    const uint32_t *const *zp_used;
+    /// Cycles of the longest call to each routine, and its context node
+    const uint64_t *max_call;
+    const uint32_t *max_call_node;
+    /// Maximum cycles of each call to a routine, 0 if no limit, and number of
+    /// calls over the limit
+    const uint64_t *budget;
+    const uint64_t *over_budget;
+    /// Cycles of the shortest call to each routine, number of calls that
+    /// returned and total cycles of those calls
+    const uint64_t *min_call;
+    const uint64_t *ret_calls;
+    const uint64_t *ret_cycles;
+};
+
+/// Number of buckets in the loop trip count histogram
+#define SIM65_LOOP_TRIPS 17
+
+/// Loop profile, for each backward branch target.
+struct sim65_loop
+{
+    /// First address of the loop, the target of the backward branches
+    uint16_t head;
+    /// Address of the last backward branch
+    uint16_t tail;
+    /// Number of times the loop was run, and total iterations
+    uint64_t runs;
+    uint64_t iterations;
+    /// Cycles executed from the start to the end of each run
+    uint64_t cycles;
+    /// Maximum iterations of one run
+    uint64_t max_trips;
+    /// Histogram of the iterations of each run: bucket "n" counts the runs with
+    /// 2^n to 2^(n+1)-1 iterations, the last bucket also the longer runs.
+    uint64_t trips[SIM65_LOOP_TRIPS];
+};
+
+/// Dead stores and redundant loads, for each address.
+struct sim65_dataflow
+{
+    /// Times the store at each address was overwritten before being read,
+    /// and the cycles of those executions.
+    const uint64_t *dead_stores;
+    const uint64_t *dead_cycles;
+    /// Times the load or transfer at each address got the value that the
+    /// register already held, from the same memory location or immediate,
+    /// and the cycles of those executions.
+    const uint64_t *redundant_loads;
+    const uint64_t *redundant_cycles;
+};
+
 /// Creates new simulator state, with no address regions defined.
 sim65 sim65_new();
 /// Deletes simulator state, freeing all memory.
@@ -113,12 +233,60 @@ void sim65_add_data_rom(sim65 s, unsigned addr, const unsigned char *data, unsig
 void sim65_set_debug(sim65 s, enum sim65_debug level);
 /// Sets tracing file, instead of stderr..
 void sim65_set_trace_file(sim65 s, FILE *f);
+/// Sets binary trace file, storing all executed instructions in a compact format.
+/// The file is written from a background thread, use a null file name to stop.
+/// @returns 0 if no error.
+int sim65_set_binary_trace(sim65 s, const char *fname);
+/// Sets memory access trace file, storing all reads and writes to the address
+/// ranges added with sim65_add_mem_trace. Use a null file name to stop.
+/// @returns 0 if no error.
+int sim65_set_mem_trace(sim65 s, const char *fname);
+/// Adds an address range to the memory access trace.
+void sim65_add_mem_trace(sim65 s, unsigned addr, unsigned len);
+/// Enables checkpoints of the simulation state every "interval" cycles, using
+/// up to "max_mem" bytes of memory. When the memory is full, every other
+/// checkpoint is dropped and the interval is doubled.
+/// Use an interval of 0 to disable.
+void sim65_set_checkpoints(sim65 s, uint64_t interval, uint64_t max_mem);
+/// Returns the cycles of the oldest checkpoint.
+uint64_t sim65_get_checkpoint_start(const sim65 s);
+/// Rewinds the simulation to the given cycle, restoring the previous
+/// checkpoint and re-executing up to the first instruction at or after
+/// the cycle. Host device state is not restored, so the callbacks must
+/// give the same results when re-executed.
+/// @returns sim65_err_none if the cycle was reached.
+enum sim65_error sim65_rewind(sim65 s, uint64_t cycle);
+/// Continues re-execution after sim65_rewind, up to the given cycle.
+/// @returns sim65_err_none if the cycle was reached.
+enum sim65_error sim65_replay(sim65 s, uint64_t cycle);
+/// Searches the last write to the given address, re-executing from the
+/// checkpoints up to the current cycle.
+/// @returns the cycles at the start of the instruction, or -1 if not found.
+int64_t sim65_find_last_write(sim65 s, uint16_t addr);
+/// Returns 1 if the simulation is being re-executed from a checkpoint.
+int sim65_is_rewinding(const sim65 s);
+/// Trace window, limits the text and binary traces to a part of the simulation.
+struct sim65_trace_window
+{
+    /// Start tracing when the PC reaches this address, -1 for any address.
+    int start_addr;
+    /// Start tracing after this number of cycles.
+    uint64_t start_cycle;
+    /// Stop tracing after this number of instructions, 0 for no limit.
+    uint64_t count;
+    /// Stop tracing on return from the subroutine active at the start.
+    int stop_ret;
+    /// Stop tracing on a write to this address, -1 to disable.
+    int stop_write;
+};
+/// Sets the trace window, use a null pointer to trace the full simulation.
+void sim65_set_trace_window(sim65 s, const struct sim65_trace_window *w);
 /// Sets the error level to "level"
 void sim65_set_error_level(sim65 s, enum sim65_error_lvl level);
 /// Prints message if debug flag was given debug
-int sim65_dprintf(sim65 s, const char *format, ...);
+int sim65_dprintf(sim65 s, const char *format, ...) __attribute__((format(printf, 2, 3)));
 /// Prints error message always
-int sim65_eprintf(sim65 s, const char *format, ...);
+int sim65_eprintf(sim65 s, const char *format, ...) __attribute__((format(printf, 2, 3)));
 
 /// Struct used to pass the register values
 struct sim65_reg
@@ -216,13 +384,144 @@ struct sim65_profile sim65_get_profile_info(const sim65 s);
 /// @returns 0 if no error.
 int sim65_save_profile_data(const sim65 s, const char *fname);
 
-/// Read profile data from a file.
+/// Read profile data from a file, adding it to the current profile data.
 /// @returns 0 if no error.
 int sim65_load_profile_data(sim65 s, const char *fname);
 
+/// Adds the profile data to a file, reading the current contents and
+/// writing the sum with the file locked, so concurrent processes can
+/// update the same file.
+/// @returns 0 if no error.
+int sim65_update_profile_data(sim65 s, const char *fname);
+
+/// Adds the profile data from other simulator to this one.
+void sim65_add_profile_data(sim65 s, const sim65 src);
+
+/// Writes the profile by address, one line for each executed instruction,
+/// followed by the totals of instructions, branches and page crossings.
+/// If disasm is set the lines show the disassembly of the instruction,
+/// else the execution count and the label.
+/// @returns the width of the cycle counts, to align further reports.
+int sim65_store_prof_summary(FILE *f, const sim65 s, int disasm);
+
+/// Activate memory access profiling, counting the data reads and writes to
+/// each address while instruction profiling is active.
+void sim65_set_mem_profiling(sim65 s, int set);
+
+/// Activate call graph profiling, the calls and returns are tracked in a
+/// shadow stack while instruction profiling is active.
+/// @returns 0 if no error.
+int sim65_set_call_profiling(sim65 s, int set);
+
+/// Sampling profile information.
+struct sim65_sample_profile
+{
+    /// Mean number of cycles between samples, 0 if sampling is not active
+    uint64_t period;
+    /// Total number of samples
+    uint64_t total;
+    /// Number of samples at each address
+    const uint64_t *samples;
+};
+
+/// Activates the sampling profiler, recording the PC each "period" cycles
+/// on average, with random jitter to avoid synchronizing with loops. With
+/// "stacks", also records the calling context of the samples, available in
+/// the "samples" field of the call graph nodes. Without call profiling, the
+/// context is read from the return addresses in the stack page.
+/// Use a period of 0 to disable.
+/// @returns 0 if no error.
+int sim65_set_sampling(sim65 s, uint64_t period, int stacks);
+
+/// Gets sampling profile information.
+struct sim65_sample_profile sim65_get_sample_profile(const sim65 s);
+
+/// Coverage flags of each address.
+enum sim65_cov_flags
+{
+    /// Executed, continuing to the next instruction
+    sim65_cov_next = 1,
+    /// Executed, jumping to other address (taken branch, jump, call or return)
+    sim65_cov_jump = 2,
+    /// Executed instruction is a conditional branch
+    sim65_cov_branch = 4
+};
+
+/// Activates code coverage, only recording the flags of each executed
+/// address, this is a lot faster than profiling.
+/// @returns 0 if no error.
+int sim65_set_coverage(sim65 s, int set);
+
+/// Gets the coverage flags of each address, null if coverage is not active.
+const uint8_t *sim65_get_coverage(const sim65 s);
+
+/// Activates loop profiling, with instruction profiling active.
+/// @returns 0 if no error.
+int sim65_set_loop_profiling(sim65 s, int set);
+
+/// Gets the loop profile, in the order the loops were found.
+/// @returns the number of loops found.
+unsigned sim65_get_loops(const sim65 s, const struct sim65_loop **list);
+
+/// Activates the detection of dead stores and redundant loads, with
+/// instruction and memory profiling active. This tracks the last writer of
+/// each memory location and the source of each register value.
+/// @returns 0 if no error.
+int sim65_set_dataflow(sim65 s, int set);
+
+/// Gets the dead stores and redundant loads.
+/// @returns 0 if the detection is not active.
+int sim65_get_dataflow(const sim65 s, struct sim65_dataflow *d);
+
+/// Gets call graph profiling information.
+/// @returns 0 if call graph profiling is not active.
+int sim65_get_call_profile(const sim65 s, struct sim65_call_profile *p);
+
+/// Sets the maximum cycles of each call to the routine at the given address,
+/// the calls over the limit are counted in the call graph profile.
+/// @returns 0 if no error, 1 if call graph profiling is not active.
+int sim65_set_cycle_budget(sim65 s, uint16_t addr, uint64_t cycles);
+
+/// Returns the cycles of the calls to a routine at the given percentile
+/// (0 to 100), within 6%, from a histogram of the calls that returned.
+uint64_t sim65_call_percentile(const sim65 s, uint32_t id, double pct);
+
+/// Enters a native handler frame in the call graph, with the name given as
+/// a printf format, for example "[CIO:D:GETCHR]". Call from an execution
+/// callback, the frame ends on the return from the current routine.
+void sim65_prof_enter(sim65 s, const char *format, ...);
+
+/// Returns the name of a routine from the call graph: the label, the
+/// native frame name or the address in hex, written to the given buffer.
+const char *sim65_prof_name(const sim65 s, uint32_t id, char buf[32]);
+
+/// Returns the mnemonic of an opcode, undocumented opcodes in lowercase.
+const char *sim65_opcode_name(uint8_t op);
+
+/// Returns the addressing mode of an opcode, as "abs,x" or "(ind),y".
+const char *sim65_opcode_mode(uint8_t op);
+
+/// Returns the length of an instruction, from 1 to 3 bytes.
+unsigned sim65_opcode_len(uint8_t op);
+
 /// Returns name of label in given location, or null pointer if not found
 const char *sim65_get_label(const sim65 s, uint16_t addr);
 
+/// Returns the address of the label with the given name, or -1 if not found
+int sim65_lbl_find(const sim65 s, const char *name);
+
+/// Maximum length of the flight recorder
+#define SIM65_MAX_HISTORY 65536
+
+/// Sets the length of the flight recorder, the list of last instructions
+/// executed that is printed when the simulation stops with an error.
+/// A length of 0 disables the recorder, the length is limited to
+/// SIM65_MAX_HISTORY.
+void sim65_set_history(sim65 s, unsigned len);
+
+/// Prints the last instructions executed to given file
+void sim65_print_history(const sim65 s, FILE *f);
+
 /// Disassembles the givenn address to the buffer, length should be > 128.
 /// @returns the same buffer passed.
 char *sim65_disassemble(const sim65 s, char *buf, uint16_t addr);
@@ -0,0 +1,474 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Compares profile data files, to find cycle regressions, and merges them */
+#include "sim65.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char *prog_name;
+
+static void print_help(void)
+{
+    fprintf(stderr, "Usage: %s [options] <profile A> <profile B>\n"
+                    "       %s [options] -o <output> <profiles...>\n"
+                    "Compares two profile data files written with 'atarisim -P', showing\n"
+                    "the change in each routine from A to B, ranked by absolute change.\n"
+                    "With '-o', adds all the given profile data files into one.\n"
+                    "Options:\n"
+                    " -h: Show this help\n"
+                    " -l <file>: Loads label file for both profiles.\n"
+                    " -a <file>: Loads label file for profile A only.\n"
+                    " -b <file>: Loads label file for profile B only.\n"
+                    " -n <num>: Number of routines to show, default all that changed.\n"
+                    " -t <pct>: Fail if any routine increases cycles more than <pct>%%.\n"
+                    " -T <pct>: Fail if the total cycles increase more than <pct>%%.\n"
+                    " -m <num>: Ignore routine increases of less than <num> cycles.\n"
+                    " -o <file>: Merge all profiles into the given profile data file.\n"
+                    " -p <file>: Store the merged profile information into file.\n"
+                    " -i <file>: Read the names of profiles to merge from file, one per\n"
+                    "            line, in addition to the ones in the command line.\n"
+                    " -j <num>: Number of threads used to merge, default is the number\n"
+                    "           of processors.\n"
+                    "\n"
+                    "Routines are the code from each label to the next one, matched by\n"
+                    "name between the two profiles. The exit status is 2 if a limit\n"
+                    "given with '-t' or '-T' is exceeded.\n",
+            prog_name, prog_name);
+}
+
+static void print_error(const char *text)
+{
+    if (text)
+        fprintf(stderr, "%s: %s\n", prog_name, text);
+    fprintf(stderr, "%s: Try '-h' for help.\n", prog_name);
+    exit(1);
+}
+
+static void exit_error(const char *text)
+{
+    fprintf(stderr, "%s: %s.\n", prog_name, text);
+    exit(1);
+}
+
+// Totals of one routine in one profile
+struct prof_sum
+{
+    uint64_t cycles;
+    uint64_t count;
+    uint64_t taken;
+    uint64_t extra;
+};
+
+struct routine
+{
+    char name[32];
+    struct prof_sum p[2];
+};
+
+static struct routine *routines;
+static unsigned num_routines, max_routines;
+// Hash table of routine names, with the routine index plus one, 0 is empty
+static unsigned *routine_hash;
+
+static unsigned name_hash(const char *name)
+{
+    uint32_t h = 2166136261U;
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+    return h;
+}
+
+// Returns the slot of the hash table with the given name, or the empty slot
+// to insert it. The table has twice the entries of the routine array.
+static unsigned *hash_slot(const char *name)
+{
+    unsigned mask = max_routines * 2 - 1;
+    unsigned i    = name_hash(name) & mask;
+    while (routine_hash[i] && strcmp(routines[routine_hash[i] - 1].name, name))
+        i = (i + 1) & mask;
+    return &routine_hash[i];
+}
+
+static struct routine *get_routine(const char *name)
+{
+    char key[sizeof(routines->name)];
+    snprintf(key, sizeof(key), "%s", name);
+    if (num_routines == max_routines)
+    {
+        // Grow the arrays and rebuild the hash table
+        unsigned nmax     = max_routines ? max_routines * 2 : 1024;
+        struct routine *r = realloc(routines, nmax * sizeof(*r));
+        if (!r)
+            exit_error("memory error");
+        routines = r;
+        free(routine_hash);
+        routine_hash = calloc(nmax * 2, sizeof(unsigned));
+        if (!routine_hash)
+            exit_error("memory error");
+        max_routines = nmax;
+        for (unsigned i = 0; i < num_routines; i++)
+            *hash_slot(routines[i].name) = i + 1;
+    }
+    unsigned *slot = hash_slot(key);
+    if (*slot)
+        return &routines[*slot - 1];
+    struct routine *r = &routines[num_routines++];
+    memset(r, 0, sizeof(*r));
+    memcpy(r->name, key, sizeof(key));
+    *slot = num_routines;
+    return r;
+}
+
+// Adds the profile of each routine, from each label to the next one.
+// Local labels starting with '@' are part of the previous routine.
+static void add_profile(sim65 s, int n, struct prof_sum *total)
+{
+    struct sim65_profile pdata = sim65_get_profile_info(s);
+    struct routine *r          = 0;
+    char buf[32];
+    for (unsigned i = 0; i < 0x10000; i++)
+    {
+        const char *lbl = sim65_get_label(s, i);
+        if (lbl && *lbl && *lbl != '@')
+            r = 0;
+        if (!pdata.cycle_count[i])
+            continue;
+        if (!r)
+        {
+            // Search the label of the routine
+            unsigned j = i;
+            while (j && !((lbl = sim65_get_label(s, j)) && *lbl && *lbl != '@'))
+                j--;
+            if (!lbl || !*lbl || *lbl == '@')
+            {
+                snprintf(buf, sizeof(buf), "$%04X", j);
+                lbl = buf;
+            }
+            r = get_routine(lbl);
+        }
+        r->p[n].cycles += pdata.cycle_count[i];
+        r->p[n].count += pdata.exec_count[i];
+        r->p[n].taken += pdata.branch_taken[i];
+        r->p[n].extra += pdata.extra_cycles[i];
+    }
+    for (unsigned i = 0; i < 0x10000; i++)
+    {
+        total->cycles += pdata.cycle_count[i];
+        total->count += pdata.exec_count[i];
+        total->taken += pdata.branch_taken[i];
+        total->extra += pdata.extra_cycles[i];
+    }
+}
+
+static int64_t change(const struct routine *r)
+{
+    return (int64_t)(r->p[1].cycles - r->p[0].cycles);
+}
+
+static int cmp_change(const void *a, const void *b)
+{
+    int64_t ca = change(a), cb = change(b);
+    uint64_t aa = ca < 0 ? -ca : ca, ab = cb < 0 ? -cb : cb;
+    return (aa < ab) - (aa > ab);
+}
+
+static int cmp_cycles(const void *a, const void *b)
+{
+    const struct routine *ra = a, *rb = b;
+    return (ra->p[0].cycles < rb->p[0].cycles) - (ra->p[0].cycles > rb->p[0].cycles);
+}
+
+static double percent(uint64_t a, uint64_t b)
+{
+    if (!a)
+        return b ? 100.0 : 0.0;
+    return 100.0 * ((double)b - (double)a) / (double)a;
+}
+
+static void print_line(const struct prof_sum *p, const char *name)
+{
+    printf("%11" PRIu64 " %11" PRIu64 " %+11" PRId64 " %+7.1f%% %10" PRIu64 " %10" PRIu64
+           " %+8" PRId64 " %+8" PRId64 " %s\n",
+           p[0].cycles, p[1].cycles, (int64_t)(p[1].cycles - p[0].cycles),
+           percent(p[0].cycles, p[1].cycles), p[0].count, p[1].count,
+           (int64_t)(p[1].taken - p[0].taken), (int64_t)(p[1].extra - p[0].extra), name);
+}
+
+// Merges a list of profiles, each thread adds a part of the list
+struct merge_job
+{
+    sim65 s;
+    char **files;
+    unsigned start, end;
+    int error;
+};
+
+static void *merge_thread(void *arg)
+{
+    struct merge_job *job = arg;
+    for (unsigned i = job->start; i < job->end && !job->error; i++)
+    {
+        if (access(job->files[i], R_OK))
+        {
+            perror(job->files[i]);
+            job->error = 1;
+        }
+        else if (sim65_load_profile_data(job->s, job->files[i]))
+        {
+            fprintf(stderr, "%s: invalid profile data\n", job->files[i]);
+            job->error = 1;
+        }
+    }
+    return 0;
+}
+
+static void merge_profiles(sim65 s, char **files, unsigned num, unsigned nthreads)
+{
+    if (nthreads > num)
+        nthreads = num;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    struct merge_job *job = calloc(nthreads, sizeof(*job));
+    pthread_t *th         = calloc(nthreads, sizeof(*th));
+    if (!job || !th)
+        exit_error("memory error");
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        job[i].s     = i ? sim65_new() : s;
+        job[i].files = files;
+        job[i].start = (uint64_t)num * i / nthreads;
+        job[i].end   = (uint64_t)num * (i + 1) / nthreads;
+        if (!job[i].s)
+            exit_error("memory error");
+        if (pthread_create(&th[i], 0, merge_thread, &job[i]))
+            exit_error("can't create thread");
+    }
+    // Join and add results into the first
+    int error = 0;
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        pthread_join(th[i], 0);
+        error |= job[i].error;
+        if (!i)
+            continue;
+        sim65_add_profile_data(s, job[i].s);
+        sim65_free(job[i].s);
+    }
+    free(job);
+    free(th);
+    if (error)
+        exit_error("can't read profile data");
+}
+
+// Reads a list of file names, one per line
+static void read_list(const char *fname, char ***files, unsigned *num)
+{
+    FILE *f = fopen(fname, "r");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't read list of profiles");
+    }
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), f))
+    {
+        buf[strcspn(buf, "\r\n")] = 0;
+        if (!*buf)
+            continue;
+        if (!(*num & (*num + 1)))
+            *files = realloc(*files, (*num + 1) * 2 * sizeof(char *));
+        if (!*files || !((*files)[*num] = strdup(buf)))
+            exit_error("memory error");
+        (*num)++;
+    }
+    fclose(f);
+}
+
+// Writes the merged profile, by address and by routine
+static void store_report(const char *fname, sim65 s)
+{
+    FILE *f = fopen(fname, "w");
+    if (!f)
+    {
+        perror(fname);
+        exit_error("can't open profile");
+    }
+    int digits = sim65_store_prof_summary(f, s, 0);
+
+    // Routines, by cycles
+    struct prof_sum total;
+    memset(&total, 0, sizeof(total));
+    add_profile(s, 0, &total);
+    qsort(routines, num_routines, sizeof(struct routine), cmp_cycles);
+    fprintf(f, "--------- Routines: cycles, instructions, branches taken, page crossings\n");
+    for (unsigned i = 0; i < num_routines; i++)
+    {
+        const struct prof_sum *p = &routines[i].p[0];
+        fprintf(f, "%*" PRIu64 " %5.1f%% %*" PRIu64 " %*" PRIu64 " %*" PRIu64 " %s\n",
+                digits, p->cycles, 100.0 * p->cycles / total.cycles, digits, p->count,
+                digits, p->taken, digits, p->extra, routines[i].name);
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    prog_name = argv[0];
+    sim65 s[2];
+    s[0] = sim65_new();
+    s[1] = sim65_new();
+    if (!s[0] || !s[1])
+        exit_error("internal error");
+
+    unsigned max_list = 0;
+    double max_routine = -1, max_total = -1;
+    uint64_t min_cycles = 0;
+    const char *merge_name = 0, *report_name = 0;
+    long nthreads          = sysconf(_SC_NPROCESSORS_ONLN);
+    char **files           = 0;
+    unsigned num_files     = 0;
+    while ((opt = getopt(argc, argv, "hl:a:b:n:t:T:m:o:p:i:j:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'h': // help
+                print_help();
+                return 0;
+            case 'l': // labels for both
+                sim65_lbl_load(s[0], optarg);
+                sim65_lbl_load(s[1], optarg);
+                break;
+            case 'a': // labels for A
+                sim65_lbl_load(s[0], optarg);
+                break;
+            case 'b': // labels for B
+                sim65_lbl_load(s[1], optarg);
+                break;
+            case 'n': // number of routines
+                max_list = strtoul(optarg, 0, 0);
+                break;
+            case 't': // routine limit
+                max_routine = strtod(optarg, 0);
+                break;
+            case 'T': // total limit
+                max_total = strtod(optarg, 0);
+                break;
+            case 'm': // minimum change
+                min_cycles = strtoull(optarg, 0, 0);
+                break;
+            case 'o': // merge output
+                merge_name = optarg;
+                break;
+            case 'p': // merge report
+                report_name = optarg;
+                break;
+            case 'i': // list of profiles
+                read_list(optarg, &files, &num_files);
+                break;
+            case 'j': // threads
+                nthreads = strtol(optarg, 0, 0);
+                break;
+            default:
+                print_error(0);
+        }
+    }
+    if (merge_name || report_name)
+    {
+        for (int i = optind; i < argc; i++)
+        {
+            if (!(num_files & (num_files + 1)))
+                files = realloc(files, (num_files + 1) * 2 * sizeof(char *));
+            if (!files || !(files[num_files] = strdup(argv[i])))
+                exit_error("memory error");
+            num_files++;
+        }
+        if (!num_files)
+            print_error("need profile data files to merge");
+        merge_profiles(s[0], files, num_files, nthreads);
+        int e = merge_name && sim65_save_profile_data(s[0], merge_name);
+        if (report_name)
+            store_report(report_name, s[0]);
+        for (unsigned i = 0; i < num_files; i++)
+            free(files[i]);
+        free(files);
+        free(routines);
+        free(routine_hash);
+        sim65_free(s[0]);
+        sim65_free(s[1]);
+        return e;
+    }
+
+    if (optind + 2 != argc)
+        print_error("need two profile data files");
+
+    struct prof_sum total[2];
+    memset(total, 0, sizeof(total));
+    for (int n = 0; n < 2; n++)
+    {
+        const char *fname = argv[optind + n];
+        if (access(fname, R_OK))
+        {
+            perror(fname);
+            exit_error("can't read profile data");
+        }
+        if (sim65_load_profile_data(s[n], fname))
+            exit_error("can't read profile data");
+        add_profile(s[n], n, &total[n]);
+    }
+
+    qsort(routines, num_routines, sizeof(struct routine), cmp_change);
+    printf("   cycles A    cycles B      change         instrs A   instrs B"
+           "    taken    xpage routine\n");
+    int fail = 0;
+    for (unsigned i = 0; i < num_routines; i++)
+    {
+        const struct routine *r = &routines[i];
+        int64_t ch              = change(r);
+        if (max_routine >= 0 && ch > 0 && (uint64_t)ch >= min_cycles &&
+            percent(r->p[0].cycles, r->p[1].cycles) > max_routine)
+        {
+            fprintf(stderr, "%s: routine '%s' cycles increased %+.1f%%\n", prog_name,
+                    r->name, percent(r->p[0].cycles, r->p[1].cycles));
+            fail = 1;
+        }
+        if ((!max_list && ch) || i < max_list)
+            print_line(r->p, r->name);
+    }
+    print_line(total, "(total)");
+    if (max_total >= 0 && percent(total[0].cycles, total[1].cycles) > max_total)
+    {
+        fprintf(stderr, "%s: total cycles increased %+.1f%%\n", prog_name,
+                percent(total[0].cycles, total[1].cycles));
+        fail = 1;
+    }
+
+    free(routines);
+    free(routine_hash);
+    sim65_free(s[0]);
+    sim65_free(s[1]);
+    return fail ? 2 : 0;
+}
@@ -0,0 +1,477 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Converts binary trace files to text and analyzes them */
+#include "sim65.h"
+#include "tracefile.h"
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char *prog_name;
+
+static void print_help(void)
+{
+    fprintf(stderr, "Usage: %s [options] <trace file>\n"
+                    "Options:\n"
+                    " -h: Show this help\n"
+                    " -m: The file is a memory access trace, written with 'atarisim -m'.\n"
+                    " -l <file>: Loads label file, used in the disassembly. With multiple\n"
+                    "            label files loaded, last one takes precedence.\n"
+                    " -o <file>: Write text trace to file instead of standard output.\n"
+                    " -c <range>: Only process cycles in range 'start-end', 'start-' or\n"
+                    "            '-end'. Uses the trace index to skip to the start.\n"
+                    " -s: Show statistics instead of the text trace: hot instructions,\n"
+                    "     memory writes and subroutine calls.\n"
+                    " -n <num>: Number of entries in each statistics list, default 20.\n"
+                    " -j <num>: Number of threads used for statistics, default is the\n"
+                    "           number of processors.\n",
+            prog_name);
+}
+
+static void print_error(const char *text)
+{
+    if (text)
+        fprintf(stderr, "%s: %s\n", prog_name, text);
+    fprintf(stderr, "%s: Try '-h' for help.\n", prog_name);
+    exit(1);
+}
+
+static void exit_error(const char *text)
+{
+    fprintf(stderr, "%s: %s.\n", prog_name, text);
+    exit(1);
+}
+
+// Prints one record in the same format as the simulator trace
+static void print_rec(sim65 s, FILE *f, const struct trace_rec *r)
+{
+    char buf[256];
+    // Place instruction in memory to disassemble
+    sim65_add_data_ram(s, r->pc, r->ins, r->flags & trace_flag_len);
+    fprintf(f, "%08" PRIX64 ": A=%02X X=%02X Y=%02X P=%02X S=%02X PC=%04X %s",
+            r->cycles, r->a, r->x, r->y, r->p, r->s, r->pc,
+            sim65_disassemble(s, buf, r->pc));
+    if (r->flags & trace_flag_write)
+        fprintf(f, "  W $%04X=$%02X", r->waddr, r->wval);
+    putc('\n', f);
+}
+
+// Cycle range to process
+static uint64_t cyc_start = 0, cyc_end = UINT64_MAX;
+
+// Opens the trace, exits on error
+static trace_reader *open_trace(const char *fname)
+{
+    trace_reader *r = trace_reader_open(fname);
+    if (!r)
+    {
+        perror(fname);
+        exit_error("can't open binary trace");
+    }
+    return r;
+}
+
+// Returns first block with records in the cycle range, and stores in "end"
+// the block after the range.
+static unsigned block_range(const struct trace_index *idx, unsigned n, unsigned *end)
+{
+    unsigned b0 = 0, b1 = n;
+    while (b0 + 1 < n && idx[b0 + 1].cycles <= cyc_start)
+        b0++;
+    while (b1 > b0 + 1 && idx[b1 - 1].cycles >= cyc_end)
+        b1--;
+    *end = b1;
+    return b0;
+}
+
+// Prints the text trace
+static void print_trace(sim65 s, FILE *f, const char *fname)
+{
+    const struct trace_index *idx;
+    trace_reader *r = open_trace(fname);
+    unsigned n      = trace_reader_get_index(r, &idx), end;
+    if (n && cyc_start)
+        trace_reader_seek(r, block_range(idx, n, &end));
+
+    struct trace_rec rec;
+    int e;
+    while (0 < (e = trace_reader_next(r, &rec)) && rec.cycles < cyc_end)
+        if (rec.cycles >= cyc_start)
+            print_rec(s, f, &rec);
+    trace_reader_close(r);
+    if (e < 0)
+        exit_error("invalid trace file");
+}
+
+// Prints the memory access trace
+static void print_mtrace(sim65 s, FILE *f, const char *fname)
+{
+    mtrace_file *m = mtrace_open(fname);
+    if (!m)
+    {
+        perror(fname);
+        exit_error("can't open memory access trace");
+    }
+    struct mtrace_rec rec;
+    int e;
+    while (0 < (e = mtrace_next(m, &rec)) && rec.cycles < cyc_end)
+    {
+        if (rec.cycles < cyc_start)
+            continue;
+        const char *lpc  = sim65_get_label(s, rec.pc);
+        const char *ladr = sim65_get_label(s, rec.addr);
+        fprintf(f, "%08" PRIX64 ": PC=%04X %-16s %c $%04X=$%02X %s\n", rec.cycles, rec.pc,
+                lpc ? lpc : "", (rec.flags & mtrace_flag_write) ? 'W' : 'R', rec.addr,
+                rec.val, ladr ? ladr : "");
+    }
+    mtrace_close(m);
+    if (e < 0)
+        exit_error("invalid memory access trace file");
+}
+
+// Statistics of a part of the trace
+struct call_edge
+{
+    uint32_t key; // (caller << 16) | callee, plus one so zero is empty
+    uint64_t count;
+};
+
+struct trace_stats
+{
+    // Input: file name and block range, end = 0 to read all the file
+    const char *fname;
+    unsigned start, end;
+    uint64_t nrec;
+    // Output
+    int error;
+    uint64_t ins;
+    uint64_t first, last;
+    uint64_t count[0x10000];
+    uint64_t cycles[0x10000];
+    uint64_t writes[0x10000];
+    uint8_t code[0x10000][4];
+    struct call_edge *edges;
+    unsigned edge_mask, nedges;
+};
+
+static void add_edge(struct trace_stats *st, uint32_t key, uint64_t count)
+{
+    if (st->nedges * 2 >= st->edge_mask)
+    {
+        // Grow hash table
+        struct call_edge *old = st->edges;
+        unsigned old_size     = old ? st->edge_mask + 1 : 0;
+        st->edge_mask         = st->edge_mask * 2 + 1;
+        st->edges             = calloc(st->edge_mask + 1, sizeof(*st->edges));
+        if (!st->edges)
+            exit_error("out of memory");
+        st->nedges = 0;
+        for (unsigned i = 0; i < old_size; i++)
+            if (old[i].key)
+                add_edge(st, old[i].key - 1, old[i].count);
+        free(old);
+    }
+    unsigned h = (key * 2654435761u) & st->edge_mask;
+    while (st->edges[h].key && st->edges[h].key != key + 1)
+        h = (h + 1) & st->edge_mask;
+    if (!st->edges[h].key)
+    {
+        st->edges[h].key = key + 1;
+        st->nedges++;
+    }
+    st->edges[h].count += count;
+}
+
+// Accumulates one instruction, with the cycles up to the next one
+static void stats_add(struct trace_stats *st, const struct trace_rec *r, uint64_t cycles)
+{
+    if (r->cycles < cyc_start || r->cycles >= cyc_end)
+        return;
+    if (!st->ins)
+        st->first = r->cycles;
+    st->last = r->cycles + cycles;
+    st->ins++;
+    st->count[r->pc]++;
+    st->cycles[r->pc] += cycles;
+    memcpy(st->code[r->pc], r->ins, 3);
+    st->code[r->pc][3] = r->flags & trace_flag_len;
+    if (r->flags & trace_flag_write)
+        st->writes[r->waddr]++;
+    if (r->ins[0] == 0x20) // JSR
+        add_edge(st, (r->pc << 16) | r->ins[1] | (r->ins[2] << 8), 1);
+}
+
+static void *stats_thread(void *arg)
+{
+    struct trace_stats *st = arg;
+    trace_reader *r        = trace_reader_open(st->fname);
+    struct trace_rec rec, next;
+    uint64_t n = 0;
+    int e;
+
+    if (!r || (st->end && trace_reader_seek(r, st->start)))
+    {
+        st->error = 1;
+        trace_reader_close(r);
+        return 0;
+    }
+    e = trace_reader_next(r, &rec);
+    while (e > 0 && (!st->end || n < st->nrec) && rec.cycles < cyc_end)
+    {
+        // Read one record more to get the cycles of the last one
+        e = trace_reader_next(r, &next);
+        if (e > 0)
+            stats_add(st, &rec, next.cycles - rec.cycles);
+        else
+            stats_add(st, &rec, 0);
+        rec = next;
+        n++;
+    }
+    if (e < 0)
+        st->error = 1;
+    trace_reader_close(r);
+    return 0;
+}
+
+// Sort indexes by descending value
+static const uint64_t *sort_val;
+static int cmp_val(const void *a, const void *b)
+{
+    uint64_t va = sort_val[*(const unsigned *)a];
+    uint64_t vb = sort_val[*(const unsigned *)b];
+    return va < vb ? 1 : va > vb ? -1 : 0;
+}
+
+static unsigned sort_top(unsigned *list, const uint64_t *val, unsigned n)
+{
+    unsigned k = 0;
+    for (unsigned i = 0; i < n; i++)
+        if (val[i])
+            list[k++] = i;
+    sort_val = val;
+    qsort(list, k, sizeof(list[0]), cmp_val);
+    return k;
+}
+
+static const char *addr_name(sim65 s, char *buf, uint16_t addr)
+{
+    const char *l = sim65_get_label(s, addr);
+    if (l && *l)
+        snprintf(buf, 64, "$%04X %s", addr, l);
+    else
+        snprintf(buf, 64, "$%04X", addr);
+    return buf;
+}
+
+static void print_stats(sim65 s, FILE *f, const char *fname, unsigned nthreads, unsigned top)
+{
+    const struct trace_index *idx;
+    trace_reader *r = open_trace(fname);
+    unsigned n      = trace_reader_get_index(r, &idx), b0 = 0, b1 = 0;
+    if (n)
+        b0 = block_range(idx, n, &b1);
+    if (!n || nthreads < 1)
+        nthreads = 1;
+    if (nthreads > b1 - b0 && n)
+        nthreads = b1 - b0;
+
+    // Split blocks between threads
+    struct trace_stats **st = calloc(nthreads, sizeof(*st));
+    pthread_t *th           = calloc(nthreads, sizeof(*th));
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        st[i] = calloc(1, sizeof(struct trace_stats));
+        if (!st[i])
+            exit_error("out of memory");
+        st[i]->fname = fname;
+        if (n)
+        {
+            unsigned e    = b0 + (uint64_t)(b1 - b0) * (i + 1) / nthreads;
+            st[i]->start  = b0 + (uint64_t)(b1 - b0) * i / nthreads;
+            st[i]->end    = e;
+            st[i]->nrec   = (e < n ? idx[e].rec : UINT64_MAX) - idx[st[i]->start].rec;
+        }
+        if (pthread_create(&th[i], 0, stats_thread, st[i]))
+            exit_error("can't create thread");
+    }
+    trace_reader_close(r);
+
+    // Join and merge results into the first
+    struct trace_stats *t = st[0];
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        pthread_join(th[i], 0);
+        if (st[i]->error)
+            exit_error("invalid trace file");
+        if (!i)
+            continue;
+        if (st[i]->ins && (!t->ins || st[i]->first < t->first))
+            t->first = st[i]->first;
+        if (st[i]->last > t->last)
+            t->last = st[i]->last;
+        t->ins += st[i]->ins;
+        for (unsigned a = 0; a < 0x10000; a++)
+        {
+            t->count[a] += st[i]->count[a];
+            t->cycles[a] += st[i]->cycles[a];
+            t->writes[a] += st[i]->writes[a];
+            if (st[i]->code[a][3])
+                memcpy(t->code[a], st[i]->code[a], 4);
+        }
+        for (unsigned e = 0; st[i]->edges && e <= st[i]->edge_mask; e++)
+            if (st[i]->edges[e].key)
+                add_edge(t, st[i]->edges[e].key - 1, st[i]->edges[e].count);
+    }
+
+    uint64_t total = t->last - t->first;
+    fprintf(f, "Instructions: %" PRIu64 ", cycles: %" PRIu64 " (from %" PRIu64 " to %" PRIu64 ")\n",
+            t->ins, total, t->first, t->last);
+
+    unsigned *list = calloc(0x10000, sizeof(*list));
+    char buf[256], lbl1[64], lbl2[64];
+    unsigned k = sort_top(list, t->cycles, 0x10000);
+    fprintf(f, "\nHot instructions:\n");
+    for (unsigned i = 0; i < k && i < top; i++)
+    {
+        unsigned pc = list[i];
+        sim65_add_data_ram(s, pc, t->code[pc], t->code[pc][3]);
+        fprintf(f, "%12" PRIu64 " %5.1f%% %10" PRIu64 " %04X %s\n", t->cycles[pc],
+                100.0 * t->cycles[pc] / (total ? total : 1), t->count[pc], pc,
+                sim65_disassemble(s, buf, pc));
+    }
+
+    k = sort_top(list, t->writes, 0x10000);
+    fprintf(f, "\nMemory writes:\n");
+    for (unsigned i = 0; i < k && i < top; i++)
+        fprintf(f, "%12" PRIu64 " %s\n", t->writes[list[i]], addr_name(s, lbl1, list[i]));
+
+    // Call edges, sorted by count
+    uint64_t *ecount = calloc(t->edge_mask + 1, sizeof(*ecount));
+    unsigned *elist  = calloc(t->edge_mask + 1, sizeof(*elist));
+    for (unsigned e = 0; t->edges && e <= t->edge_mask; e++)
+        ecount[e] = t->edges[e].count;
+    k = t->edges ? sort_top(elist, ecount, t->edge_mask + 1) : 0;
+    fprintf(f, "\nSubroutine calls:\n");
+    for (unsigned i = 0; i < k && i < top; i++)
+    {
+        uint32_t key = t->edges[elist[i]].key - 1;
+        fprintf(f, "%12" PRIu64 " %s -> %s\n", ecount[elist[i]],
+                addr_name(s, lbl1, key >> 16), addr_name(s, lbl2, key & 0xFFFF));
+    }
+
+    free(ecount);
+    free(elist);
+    free(list);
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+        free(st[i]->edges);
+        free(st[i]);
+    }
+    free(st);
+    free(th);
+}
+
+// Parses a cycle range
+static void set_range(const char *str)
+{
+    char *end;
+    if (*str != '-')
+        cyc_start = strtoull(str, &end, 0);
+    else
+        end = (char *)str;
+    if (*end == '-')
+    {
+        if (end[1])
+            cyc_end = strtoull(end + 1, &end, 0);
+        else
+            end++;
+    }
+    if (*end || cyc_end <= cyc_start)
+        print_error("invalid cycle range");
+}
+
+int main(int argc, char **argv)
+{
+    int opt, stats = 0, mem = 0;
+    prog_name = argv[0];
+    FILE *out = stdout;
+    sim65 s   = sim65_new();
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned top  = 20;
+
+    if (!s)
+        exit_error("internal error");
+
+    while ((opt = getopt(argc, argv, "hml:o:c:sn:j:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'h': // help
+                print_help();
+                return 0;
+            case 'l': // label file
+                if (sim65_lbl_load(s, optarg))
+                    exit_error("can't read label file");
+                break;
+            case 'o': // output file
+                out = fopen(optarg, "w");
+                if (!out)
+                {
+                    perror(optarg);
+                    exit_error("can't open output file");
+                }
+                break;
+            case 'c': // cycle range
+                set_range(optarg);
+                break;
+            case 'm': // memory access trace
+                mem = 1;
+                break;
+            case 's': // statistics
+                stats = 1;
+                break;
+            case 'n': // list length
+                top = strtoul(optarg, 0, 0);
+                break;
+            case 'j': // threads
+                nthreads = strtol(optarg, 0, 0);
+                break;
+            default:
+                print_error(0);
+        }
+    }
+    if (optind + 1 != argc)
+        print_error("missing trace file name");
+
+    if (mem)
+        print_mtrace(s, out, argv[optind]);
+    else if (stats)
+        print_stats(s, out, argv[optind], nthreads, top);
+    else
+        print_trace(s, out, argv[optind]);
+    if (out != stdout)
+        fclose(out);
+    sim65_free(s);
+    return 0;
+}
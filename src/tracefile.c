@@ -0,0 +1,697 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Binary trace files.
+ *
+ * The simulator thread stores raw records into a single producer / single
+ * consumer ring buffer, a background thread encodes the records and writes
+ * them to disk.
+ *
+ * The file is a header line followed by blocks of up to BLOCK_RECS records,
+ * each block is:
+ *   u32 payload length, u32 number of records,
+ *   u64 cycles, u16 PC, u8 A, X, Y, P, S of the first record,
+ *   encoded records.
+ * Each record is encoded relative to the previous one in the same block:
+ *   u8 header, varint cycle delta, then depending on header bits:
+ *   new A, X, Y, P, S; u16 PC if not the next instruction; u8 length plus
+ *   the instruction bytes if not already seen at this PC in the block;
+ *   u16 address and u8 value written to memory.
+ * As all state is reset at each block, blocks can be decoded independently.
+ *
+ * After the last block, an empty block header (8 zero bytes) marks the end
+ * of the records, followed by the index, one entry for each block:
+ *   u64 file offset, u64 record number, u64 cycles, u16 PC, u8 A, X, Y, P, S
+ * and the trailer:
+ *   u64 index file offset, u32 number of entries, 8 bytes INDEX_MAGIC.
+ * Version 1 files have no end marker and no index.
+ *
+ * Memory access traces are a header line followed by one record for each
+ * access, encoded relative to the previous one:
+ *   u8 header, varint cycle delta, then depending on header bits:
+ *   u16 PC if changed, u16 address if not the same or the next one,
+ *   u8 value.
+ */
+#include "tracefile.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAGIC    "SIM65:TRACE:2\n"
+#define TRACE_MAGIC_V1 "SIM65:TRACE:1\n"
+#define MTRACE_MAGIC   "SIM65:MTRACE:1\n"
+#define INDEX_MAGIC    "SIM65IDX"
+#define INDEX_ENTRY    (8 + 8 + 8 + 7) // Encoded index entry length
+#define INDEX_TRAILER  (8 + 4 + 8)     // Trailer length
+
+#define RING_SIZE  (1 << 16)   // Records in the ring buffer
+#define RING_BATCH (256)       // Records encoded before releasing ring space
+#define BLOCK_RECS (4096)      // Records in each file block
+#define BLOCK_HDR  (8 + 8 + 7) // Block header length
+#define REC_MAX    (32)        // Maximum encoded record length
+#define BLOCK_MAX  (BLOCK_HDR + BLOCK_RECS * REC_MAX)
+
+// Bits in the record header
+#define RH_A     0x01
+#define RH_X     0x02
+#define RH_Y     0x04
+#define RH_P     0x08
+#define RH_S     0x10
+#define RH_PC    0x20
+#define RH_WRITE 0x40
+#define RH_CODE  0x80
+
+// Bits in the memory access record header
+#define MH_WRITE     0x01
+#define MH_PC        0x02
+#define MH_ADDR_SAME 0x04
+#define MH_ADDR_NEXT 0x08
+
+// Instruction bytes seen in the current block
+struct code_image
+{
+    uint32_t gen[0x10000];
+    uint8_t code[0x10000][4];
+};
+
+struct trace_writer
+{
+    FILE *f;
+    pthread_t thread;
+    int error;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int done;
+    struct trace_rec ring[RING_SIZE];
+    // Encoder state, used only from the writer thread
+    struct trace_rec last;
+    uint32_t block;
+    unsigned nrec;
+    uint8_t *pos;
+    // Index, entry for the current block is idx[nidx]
+    uint64_t offset;
+    uint64_t total;
+    struct trace_index *idx;
+    unsigned nidx;
+    unsigned aidx;
+    struct code_image img;
+    uint8_t buf[BLOCK_MAX];
+};
+
+struct trace_reader
+{
+    FILE *f;
+    uint32_t block;
+    unsigned nrec;
+    uint8_t *pos, *end;
+    struct trace_rec last;
+    int has_end;
+    struct trace_index *idx;
+    unsigned nidx;
+    struct code_image img;
+    uint8_t buf[BLOCK_MAX + REC_MAX];
+};
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint8_t *put_le(uint8_t *p, uint64_t v, int n)
+{
+    for (int i = 0; i < n; i++, v >>= 8)
+        *p++ = v & 0xFF;
+    return p;
+}
+
+static void block_flush(trace_writer *w)
+{
+    if (!w->nrec)
+        return;
+    uint32_t len = w->pos - w->buf - 8;
+    put_le(w->buf, len, 4);
+    put_le(w->buf + 4, w->nrec, 4);
+    if (fwrite(w->buf, w->pos - w->buf, 1, w->f) < 1)
+        w->error = 1;
+    if (w->nidx < w->aidx)
+    {
+        w->idx[w->nidx].offset = w->offset;
+        w->idx[w->nidx].rec    = w->total;
+        w->nidx++;
+    }
+    w->offset += w->pos - w->buf;
+    w->total += w->nrec;
+    w->nrec = 0;
+}
+
+// Writes end of records marker, the index and the trailer
+static void index_write(trace_writer *w)
+{
+    uint8_t buf[INDEX_ENTRY];
+    memset(buf, 0, 8);
+    if (fwrite(buf, 8, 1, w->f) < 1)
+        w->error = 1;
+    uint64_t pos = w->offset + 8;
+    for (unsigned i = 0; i < w->nidx; i++)
+    {
+        const struct trace_index *e = &w->idx[i];
+        uint8_t *p                  = buf;
+        p                           = put_le(p, e->offset, 8);
+        p                           = put_le(p, e->rec, 8);
+        p                           = put_le(p, e->cycles, 8);
+        p                           = put_le(p, e->pc, 2);
+        *p++                        = e->a;
+        *p++                        = e->x;
+        *p++                        = e->y;
+        *p++                        = e->p;
+        *p++                        = e->s;
+        if (fwrite(buf, INDEX_ENTRY, 1, w->f) < 1)
+            w->error = 1;
+    }
+    uint8_t *p = put_le(buf, pos, 8);
+    p          = put_le(p, w->nidx, 4);
+    memcpy(p, INDEX_MAGIC, 8);
+    if (fwrite(buf, INDEX_TRAILER, 1, w->f) < 1)
+        w->error = 1;
+}
+
+static void encode_rec(trace_writer *w, const struct trace_rec *r)
+{
+    const unsigned len = r->flags & trace_flag_len;
+    if (!w->nrec)
+    {
+        // Start new block with full state
+        w->block++;
+        w->pos = w->buf + 8;
+        w->pos = put_le(w->pos, r->cycles, 8);
+        w->pos = put_le(w->pos, r->pc, 2);
+        *w->pos++ = r->a;
+        *w->pos++ = r->x;
+        *w->pos++ = r->y;
+        *w->pos++ = r->p;
+        *w->pos++ = r->s;
+        w->last       = *r;
+        w->last.flags = 0;
+        // Store block start into the index
+        if (w->nidx == w->aidx)
+        {
+            struct trace_index *n;
+            n = realloc(w->idx, sizeof(*n) * (w->aidx * 2 + 64));
+            if (n)
+            {
+                w->idx  = n;
+                w->aidx = w->aidx * 2 + 64;
+            }
+            else
+                w->error = 1;
+        }
+        if (w->nidx < w->aidx)
+        {
+            struct trace_index *e = &w->idx[w->nidx];
+            e->cycles             = r->cycles;
+            e->pc                 = r->pc;
+            e->a                  = r->a;
+            e->x                  = r->x;
+            e->y                  = r->y;
+            e->p                  = r->p;
+            e->s                  = r->s;
+        }
+    }
+    const struct trace_rec *l = &w->last;
+    uint8_t *code             = w->img.code[r->pc];
+    uint8_t hdr               = 0;
+    if (r->a != l->a)
+        hdr |= RH_A;
+    if (r->x != l->x)
+        hdr |= RH_X;
+    if (r->y != l->y)
+        hdr |= RH_Y;
+    if (r->p != l->p)
+        hdr |= RH_P;
+    if (r->s != l->s)
+        hdr |= RH_S;
+    if (r->pc != ((l->pc + (l->flags & trace_flag_len)) & 0xFFFF))
+        hdr |= RH_PC;
+    if (r->flags & trace_flag_write)
+        hdr |= RH_WRITE;
+    if (w->img.gen[r->pc] != w->block || code[3] != len || memcmp(code, r->ins, len))
+    {
+        hdr |= RH_CODE;
+        w->img.gen[r->pc] = w->block;
+        memcpy(code, r->ins, len);
+        code[3] = len;
+    }
+
+    uint8_t *p = w->pos;
+    *p++       = hdr;
+    p          = put_varint(p, r->cycles - l->cycles);
+    if (hdr & RH_A)
+        *p++ = r->a;
+    if (hdr & RH_X)
+        *p++ = r->x;
+    if (hdr & RH_Y)
+        *p++ = r->y;
+    if (hdr & RH_P)
+        *p++ = r->p;
+    if (hdr & RH_S)
+        *p++ = r->s;
+    if (hdr & RH_PC)
+        p = put_le(p, r->pc, 2);
+    if (hdr & RH_CODE)
+    {
+        *p++ = len;
+        memcpy(p, r->ins, len);
+        p += len;
+    }
+    if (hdr & RH_WRITE)
+    {
+        p    = put_le(p, r->waddr, 2);
+        *p++ = r->wval;
+    }
+    w->pos  = p;
+    w->last = *r;
+    if (++w->nrec == BLOCK_RECS)
+        block_flush(w);
+}
+
+static void *writer_thread(void *arg)
+{
+    trace_writer *w = arg;
+    unsigned tail   = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    for (;;)
+    {
+        // Read "done" before "head", so we see all records written before.
+        int done      = atomic_load_explicit(&w->done, memory_order_acquire);
+        unsigned head = atomic_load_explicit(&w->head, memory_order_acquire);
+        if (head == tail)
+        {
+            if (done)
+                break;
+            struct timespec ts = { 0, 1000000 };
+            nanosleep(&ts, 0);
+            continue;
+        }
+        while (head != tail)
+        {
+            encode_rec(w, &w->ring[tail & (RING_SIZE - 1)]);
+            tail++;
+            if (0 == (tail & (RING_BATCH - 1)))
+                atomic_store_explicit(&w->tail, tail, memory_order_release);
+        }
+        atomic_store_explicit(&w->tail, tail, memory_order_release);
+    }
+    block_flush(w);
+    index_write(w);
+    return 0;
+}
+
+trace_writer *trace_writer_open(const char *fname)
+{
+    trace_writer *w = calloc(1, sizeof(*w));
+    if (!w)
+        return 0;
+    w->f = fopen(fname, "wb");
+    if (!w->f)
+    {
+        free(w);
+        return 0;
+    }
+    w->offset = strlen(TRACE_MAGIC);
+    if (fputs(TRACE_MAGIC, w->f) < 0 || pthread_create(&w->thread, 0, writer_thread, w))
+    {
+        fclose(w->f);
+        free(w);
+        return 0;
+    }
+    return w;
+}
+
+void trace_writer_put(trace_writer *w, const struct trace_rec *rec)
+{
+    unsigned head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    // Wait for free space in the ring
+    while (head - atomic_load_explicit(&w->tail, memory_order_acquire) >= RING_SIZE)
+        sched_yield();
+    w->ring[head & (RING_SIZE - 1)] = *rec;
+    atomic_store_explicit(&w->head, head + 1, memory_order_release);
+}
+
+int trace_writer_close(trace_writer *w)
+{
+    if (!w)
+        return 0;
+    atomic_store_explicit(&w->done, 1, memory_order_release);
+    pthread_join(w->thread, 0);
+    int e = w->error;
+    e |= fclose(w->f) != 0;
+    free(w->idx);
+    free(w);
+    return e;
+}
+
+// Reader
+static uint64_t get_le(const uint8_t *p, int n)
+{
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static int read_block(trace_reader *r)
+{
+    uint8_t hdr[8];
+    size_t n = fread(hdr, 1, 8, r->f);
+    if (n == 0)
+        return 0;
+    uint32_t len  = get_le(hdr, 4);
+    uint32_t nrec = get_le(hdr + 4, 4);
+    if (n == 8 && !len && !nrec && r->has_end)
+        return 0;
+    if (n != 8 || len < BLOCK_HDR - 8 || len > BLOCK_MAX - 8 || !nrec || nrec > BLOCK_RECS)
+        return -1;
+    if (fread(r->buf, len, 1, r->f) < 1)
+        return -1;
+    r->block++;
+    r->nrec        = nrec;
+    r->end         = r->buf + len;
+    r->last.cycles = get_le(r->buf, 8);
+    r->last.pc     = get_le(r->buf + 8, 2);
+    r->last.a      = r->buf[10];
+    r->last.x      = r->buf[11];
+    r->last.y      = r->buf[12];
+    r->last.p      = r->buf[13];
+    r->last.s      = r->buf[14];
+    r->last.flags  = 0;
+    r->pos         = r->buf + 15;
+    return 1;
+}
+
+trace_reader *trace_reader_open(const char *fname)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    trace_reader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return 0;
+    r->f = fopen(fname, "rb");
+    if (!r->f)
+    {
+        free(r);
+        return 0;
+    }
+    if (!fgets(magic, sizeof(magic), r->f) ||
+        (strcmp(magic, TRACE_MAGIC) && strcmp(magic, TRACE_MAGIC_V1)))
+    {
+        fclose(r->f);
+        free(r);
+        return 0;
+    }
+    r->has_end = !strcmp(magic, TRACE_MAGIC);
+    return r;
+}
+
+unsigned trace_reader_get_index(trace_reader *r, const struct trace_index **idx)
+{
+    uint8_t buf[INDEX_TRAILER];
+    *idx = r->idx;
+    if (r->idx || !r->has_end)
+        return r->nidx;
+    long pos = ftell(r->f);
+    if (fseek(r->f, -INDEX_TRAILER, SEEK_END) || fread(buf, INDEX_TRAILER, 1, r->f) < 1 ||
+        memcmp(buf + 12, INDEX_MAGIC, 8))
+    {
+        fseek(r->f, pos, SEEK_SET);
+        return 0;
+    }
+    // The index must fit between its offset and the trailer
+    long end        = ftell(r->f) - INDEX_TRAILER;
+    uint64_t offset = get_le(buf, 8);
+    unsigned n      = get_le(buf + 8, 4);
+    if (end < 0 || offset > (uint64_t)end || n > ((uint64_t)end - offset) / INDEX_ENTRY)
+    {
+        fseek(r->f, pos, SEEK_SET);
+        return 0;
+    }
+    struct trace_index *x = calloc((size_t)n + 1, sizeof(*x));
+    if (!x || fseek(r->f, offset, SEEK_SET))
+    {
+        free(x);
+        fseek(r->f, pos, SEEK_SET);
+        return 0;
+    }
+    for (unsigned i = 0; i < n; i++)
+    {
+        uint8_t e[INDEX_ENTRY];
+        if (fread(e, INDEX_ENTRY, 1, r->f) < 1)
+        {
+            free(x);
+            fseek(r->f, pos, SEEK_SET);
+            return 0;
+        }
+        x[i].offset = get_le(e, 8);
+        x[i].rec    = get_le(e + 8, 8);
+        x[i].cycles = get_le(e + 16, 8);
+        x[i].pc     = get_le(e + 24, 2);
+        x[i].a      = e[26];
+        x[i].x      = e[27];
+        x[i].y      = e[28];
+        x[i].p      = e[29];
+        x[i].s      = e[30];
+    }
+    fseek(r->f, pos, SEEK_SET);
+    r->idx  = x;
+    r->nidx = n;
+    *idx    = x;
+    return n;
+}
+
+int trace_reader_seek(trace_reader *r, unsigned block)
+{
+    const struct trace_index *idx;
+    if (block >= trace_reader_get_index(r, &idx))
+        return -1;
+    if (fseek(r->f, idx[block].offset, SEEK_SET))
+        return -1;
+    r->nrec = 0;
+    return 0;
+}
+
+int trace_reader_next(trace_reader *r, struct trace_rec *rec)
+{
+    if (!r->nrec)
+    {
+        int e = read_block(r);
+        if (e <= 0)
+            return e;
+    }
+    // Records are decoded without checking the length, the buffer has space
+    // for the longest record after the end and we check at the end.
+    uint8_t *p = r->pos, *end = r->end;
+    if (p >= end)
+        return -1;
+    uint8_t hdr = *p++;
+
+    struct trace_rec n = r->last;
+    uint64_t delta     = 0;
+    for (int sh = 0; p < end && sh < 64; sh += 7)
+    {
+        delta |= (uint64_t)(*p & 0x7F) << sh;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    n.cycles += delta;
+    n.pc = (n.pc + (n.flags & trace_flag_len)) & 0xFFFF;
+    if (hdr & RH_A)
+        n.a = *p++;
+    if (hdr & RH_X)
+        n.x = *p++;
+    if (hdr & RH_Y)
+        n.y = *p++;
+    if (hdr & RH_P)
+        n.p = *p++;
+    if (hdr & RH_S)
+        n.s = *p++;
+    if (hdr & RH_PC)
+    {
+        n.pc = get_le(p, 2);
+        p += 2;
+    }
+    uint8_t *code = r->img.code[n.pc];
+    if (hdr & RH_CODE)
+    {
+        unsigned len = *p++ & trace_flag_len;
+        memcpy(code, p, len);
+        code[3] = len;
+        p += len;
+        r->img.gen[n.pc] = r->block;
+    }
+    else if (r->img.gen[n.pc] != r->block)
+        return -1;
+    memcpy(n.ins, code, 3);
+    n.flags = code[3];
+    if (hdr & RH_WRITE)
+    {
+        n.waddr = get_le(p, 2);
+        n.wval  = p[2];
+        n.flags |= trace_flag_write;
+        p += 3;
+    }
+    if (p > end)
+        return -1;
+    r->pos  = p;
+    r->last = n;
+    r->nrec--;
+    *rec = n;
+    return 1;
+}
+
+void trace_reader_close(trace_reader *r)
+{
+    if (!r)
+        return;
+    fclose(r->f);
+    free(r->idx);
+    free(r);
+}
+
+// Memory access traces
+struct mtrace_file
+{
+    FILE *f;
+    struct mtrace_rec last;
+};
+
+static mtrace_file *mtrace_fopen(const char *fname, const char *mode)
+{
+    mtrace_file *m = calloc(1, sizeof(*m));
+    if (!m)
+        return 0;
+    m->f = fopen(fname, mode);
+    if (!m->f)
+    {
+        free(m);
+        return 0;
+    }
+    return m;
+}
+
+mtrace_file *mtrace_create(const char *fname)
+{
+    mtrace_file *m = mtrace_fopen(fname, "wb");
+    if (m && fputs(MTRACE_MAGIC, m->f) < 0)
+    {
+        mtrace_close(m);
+        return 0;
+    }
+    return m;
+}
+
+void mtrace_put(mtrace_file *m, const struct mtrace_rec *rec)
+{
+    uint8_t buf[REC_MAX], *p = buf + 1;
+    const struct mtrace_rec *l = &m->last;
+    uint8_t hdr                = (rec->flags & mtrace_flag_write) ? MH_WRITE : 0;
+    p                          = put_varint(p, rec->cycles - l->cycles);
+    if (rec->pc != l->pc)
+    {
+        hdr |= MH_PC;
+        p = put_le(p, rec->pc, 2);
+    }
+    if (rec->addr == l->addr)
+        hdr |= MH_ADDR_SAME;
+    else if (rec->addr == ((l->addr + 1) & 0xFFFF))
+        hdr |= MH_ADDR_NEXT;
+    else
+        p = put_le(p, rec->addr, 2);
+    *p++    = rec->val;
+    buf[0]  = hdr;
+    m->last = *rec;
+    fwrite(buf, p - buf, 1, m->f);
+}
+
+mtrace_file *mtrace_open(const char *fname)
+{
+    char magic[sizeof(MTRACE_MAGIC)];
+    mtrace_file *m = mtrace_fopen(fname, "rb");
+    if (m && (!fgets(magic, sizeof(magic), m->f) || strcmp(magic, MTRACE_MAGIC)))
+    {
+        mtrace_close(m);
+        return 0;
+    }
+    return m;
+}
+
+int mtrace_next(mtrace_file *m, struct mtrace_rec *rec)
+{
+    struct mtrace_rec n = m->last;
+    uint64_t delta      = 0;
+    int c               = getc(m->f);
+    if (c == EOF)
+        return 0;
+    uint8_t hdr = c;
+    for (int sh = 0;; sh += 7)
+    {
+        if (EOF == (c = getc(m->f)) || sh >= 64)
+            return -1;
+        delta |= (uint64_t)(c & 0x7F) << sh;
+        if (!(c & 0x80))
+            break;
+    }
+    uint8_t buf[5], *p = buf;
+    unsigned len       = 1 + ((hdr & MH_PC) ? 2 : 0) + ((hdr & (MH_ADDR_SAME | MH_ADDR_NEXT)) ? 0 : 2);
+    if (fread(buf, len, 1, m->f) < 1)
+        return -1;
+    n.cycles += delta;
+    n.flags = (hdr & MH_WRITE) ? mtrace_flag_write : 0;
+    if (hdr & MH_PC)
+    {
+        n.pc = get_le(p, 2);
+        p += 2;
+    }
+    if (hdr & MH_ADDR_NEXT)
+        n.addr++;
+    else if (!(hdr & MH_ADDR_SAME))
+    {
+        n.addr = get_le(p, 2);
+        p += 2;
+    }
+    n.val   = *p;
+    m->last = n;
+    *rec    = n;
+    return 1;
+}
+
+int mtrace_close(mtrace_file *m)
+{
+    if (!m)
+        return 0;
+    int e = ferror(m->f) != 0;
+    e |= fclose(m->f) != 0;
+    free(m);
+    return e;
+}
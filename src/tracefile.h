@@ -0,0 +1,116 @@
+/*
+ * Mini65 - Small 6502 simulator with Atari 8bit bios.
+ * Copyright (C) 2017-2019 Daniel Serpell
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/* Binary trace files: asynchronous writer and reader */
+#pragma once
+
+#include <stdint.h>
+
+/// Flags in trace record
+enum trace_rec_flags
+{
+    /// Mask for the instruction length (1 to 3)
+    trace_flag_len = 0x03,
+    /// The instruction wrote to memory, waddr and wval hold the last write
+    trace_flag_write = 0x04,
+    /// The record is valid
+    trace_flag_valid = 0x80
+};
+
+/// One executed instruction, with the state before the execution.
+struct trace_rec
+{
+    uint64_t cycles;
+    uint16_t pc;
+    uint8_t a, x, y, p, s;
+    uint8_t ins[3];
+    uint8_t flags;
+    uint8_t wval;
+    uint16_t waddr;
+};
+
+/// Index entry, one for each block of records in the file.
+struct trace_index
+{
+    uint64_t offset; ///< File offset of the block.
+    uint64_t rec;    ///< Number of the first record of the block.
+    uint64_t cycles; ///< Register values in the first record of the block.
+    uint16_t pc;
+    uint8_t a, x, y, p, s;
+};
+
+typedef struct trace_writer trace_writer;
+typedef struct trace_reader trace_reader;
+
+/// Creates a trace file and starts the writer thread.
+/// @returns null on error.
+trace_writer *trace_writer_open(const char *fname);
+/// Adds one record to the trace, blocks only if the writer thread lags.
+void trace_writer_put(trace_writer *w, const struct trace_rec *rec);
+/// Flushes all pending records, stops the writer thread and closes the file.
+/// @returns 0 if no error.
+int trace_writer_close(trace_writer *w);
+
+/// Opens a trace file for reading.
+/// @returns null on error.
+trace_reader *trace_reader_open(const char *fname);
+/// Reads next record from the trace.
+/// @returns 1 if a record was read, 0 at end of file, -1 on error.
+int trace_reader_next(trace_reader *r, struct trace_rec *rec);
+/// Reads the index of the trace file, the index is owned by the reader.
+/// @returns the number of blocks, 0 if the file has no index.
+unsigned trace_reader_get_index(trace_reader *r, const struct trace_index **idx);
+/// Positions the reader at the start of the given block from the index.
+/// @returns 0 if no error.
+int trace_reader_seek(trace_reader *r, unsigned block);
+/// Closes trace file.
+void trace_reader_close(trace_reader *r);
+
+/// Flags in memory access record
+enum mtrace_rec_flags
+{
+    /// The access was a write
+    mtrace_flag_write = 0x01
+};
+
+/// One memory access.
+struct mtrace_rec
+{
+    uint64_t cycles;
+    uint16_t pc;
+    uint16_t addr;
+    uint8_t val;
+    uint8_t flags;
+};
+
+typedef struct mtrace_file mtrace_file;
+
+/// Creates a memory access trace file.
+/// @returns null on error.
+mtrace_file *mtrace_create(const char *fname);
+/// Adds one memory access to the trace.
+void mtrace_put(mtrace_file *m, const struct mtrace_rec *rec);
+/// Opens a memory access trace file for reading.
+/// @returns null on error.
+mtrace_file *mtrace_open(const char *fname);
+/// Reads next memory access from the trace.
+/// @returns 1 if a record was read, 0 at end of file, -1 on error.
+int mtrace_next(mtrace_file *m, struct mtrace_rec *rec);
+/// Closes memory access trace file.
+/// @returns 0 if no error.
+int mtrace_close(mtrace_file *m);